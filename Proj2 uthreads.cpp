@@ -1,72 +1,569 @@
 #include "uthreads.h"
 #include <iostream>
+#include <fstream>
+#include <iomanip>
 #include <list>
 #include <map>
+#include <set>
 #include <array>
 #include <algorithm>
-#include <csetjmp>
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <errno.h>
 #include <signal.h>
-#include <sys/time.h>
+#include <sys/auxv.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
 
+#if !defined(__x86_64__)
+#error "uthreads context switch is implemented for x86-64 only"
+#endif
 
-#define JB_SP 6
-#define JB_PC 7
+// initial mxcsr (0x1f80) and x87 control word (0x037f) of a new thread
+#define INITIAL_FP_STATE 0x037F00001F80UL
+
+// inaccessible pages below every stack, an overflow faults instead of corrupting the neighbouring mapping. At least
+// this many - guard_size widens the guard to the largest signal frame of the cpu.
+#define STACK_GUARD_PAGES 1
+
+// the workers' idle loops run on stacks of their own, sized for their calls and a signal frame whatever STACK_SIZE is
+#define IDLE_STACK_SIZE 65536
+
+// the frame initialize_frame builds - the fp state, six registers, the start routine and its return address
+#define INITIAL_FRAME_SIZE (9 * sizeof(address_t))
+
+// priority levels, 0 is the most urgent. Under the fair policy a level is a weight, doubling per level.
+#define PRIORITY_LEVELS 8
+#define DEFAULT_PRIORITY 4
+#define DEFAULT_WEIGHT 1024
+#define VRUNTIME_PER_QUANTUM (1L << 20)
+
+// quantums are counted in ticks of a periodic timer per worker, a tick being a fraction of the shortest quantum
+#define TICKS_PER_QUANTUM 4
+#define MIN_TICK_USECS 100
+
+// adaptive quantum - a thread that runs out its quantum gets a quantum twice as long next time, up to 2^3 times
+// the general quantum. With more than ADAPTIVE_CROWD READY threads on the worker the quantum shrinks, down to a
+// quarter of the general quantum.
+#define ADAPTIVE_MAX_LEVEL 3
+#define ADAPTIVE_CROWD 4
+#define ADAPTIVE_MIN_SHIFT 2
+
+// busy waiting rounds for the scheduler lock before giving the cpu to its holder
+#define LOCK_SPINS 100
+
+// ready file descriptors collected by a single poll, and the epoll data of the wakeup eventfd (not a tid)
+#define MAX_IO_EVENTS 64
+#define WAKEUP_EVENT 0xFFFFFFFFU
+
+// mutexes, condition variables, semaphores and channels that may exist at once
+#define MAX_SYNC_OBJECTS 1024
+
+// instrumentation - bucket i of the switch latency histogram counts the latencies of [2^i, 2^(i+1)) nanoseconds
+#define THREAD_STATES 3
+#define LATENCY_BUCKETS 32
 
 // typedefs
 typedef unsigned long address_t;
 
+// thread states - a WAITING thread is blocked, sleeping (for quantums or until a deadline), waiting for a file
+// descriptor and/or on a sync object
+enum thread_state {READY, RUNNING, WAITING};
+
+// scheduling policies, the values of uthread_set_policy
+enum scheduling_policy {ROUND_ROBIN, STRICT_PRIORITY, WEIGHTED_FAIR};
+
+// kinds of sync objects
+enum sync_kind {MUTEX, CONDITION, SEMAPHORE, CHANNEL};
+
+struct sync_object;
+
 // thread struct
 struct thread{
     int id;
     char * stack;
     int thread_quantums;
+    address_t sp;
+    thread_entry_point entry_point;
+    thread_state state;
+    bool blocked;
+    bool io_waiting;                    // parked in uthread_wait_fd until io_fd is ready
+    int io_fd;
+    int io_events;                      // the events io_fd was found ready for
+    long sleep_deadline;                // monotonic time uthread_sleep_usecs ends, 0 if not sleeping so
+    bool sync_waiting;                  // parked on the wait queue of wait_object
+    sync_object * wait_object;
+    std::list<int>::iterator wait_it;
+    long state_nsecs[THREAD_STATES];    // time spent in each state while the instrumentation is on
+    long state_since;
+    int voluntary_switches;
+    int preemptive_switches;
+    bool terminated;                    // terminated while RUNNING on another worker, freed when it is switched out
+    int worker;                         // the worker whose ready list holds the thread, or that runs it
+    std::list<int>::iterator ready_it;
+    int home_worker;                    // the worker whose shared stack the thread runs on, -1 for an own stack
+    char * saved_stack;                 // shared stack threads - the used part of the stack while switched out
+    size_t saved_size;
+    size_t saved_capacity;
+    int priority;
+    int quantum_usecs;                  // 0 for the general quantum
+    int quantum_level;                  // adaptive quantum - doublings earned by running out whole quantums
+    long vruntime;                      // quantums run, weighted by priority (fair policy)
+    bool in_signal_handler;             // preempted by the signal handler, resumes in it and returns by sigreturn
+};
+
+// a mutex, condition variable, semaphore or channel. The uncontended operations only touch value, the rest is
+// guarded by the scheduler lock.
+struct sync_object{
+    sync_kind kind;
+    std::atomic<int> value;     // mutex: 0 unlocked, 1 locked, 2 locked with waiters. semaphore: its value, negative
+                                // while threads wait. condition: number of waiters. channel: number of items.
+    int owner;                  // the tid holding a mutex
+    int wakeups;                // semaphore posts that found no parked waiter
+    std::list<int> waiters;
+    std::vector<void *> buffer; // channel ring buffer
+    int capacity;
+    int head;
+    sync_object * lock;         // channel mutex and semaphores
+    sync_object * slots;
+    sync_object * items;
+};
+
+// the READY threads of a worker, ordered by the scheduling policy
+struct ready_queue{
+    std::list<int> fifo;                                        // round robin
+    std::array<std::list<int>, PRIORITY_LEVELS> levels;         // strict priority, a list per level
+    unsigned int level_mask;                                    // bit i is set iff levels[i] is not empty
+    std::set<std::pair<long, int>> fair;                        // weighted fair, ordered by vruntime
+    long min_vruntime;
+    size_t size;
+    size_t pinned;                                              // shared stack threads, which cannot be stolen
+};
+
+// an entry of the trace ring buffer - the beginning ('B') or the end ('E') of a run of a thread on a worker
+struct trace_event{
+    long timestamp;
+    int worker;
+    int tid;
+    char phase;
+    bool voluntary;
+};
+
+// a kernel thread running uthreads, each with its own ready list and preemption timer
+struct worker{
+    int id;
+    ready_queue ready_lst;
+    int running_thread;
+    thread * running;                   // the control block of running_thread, read by the signal handler unlocked
+    std::atomic<int> in_critical;       // counted, so an increment that hit the wrong worker can be undone
+    volatile sig_atomic_t preempt_pending;
+    int quantums;
+    volatile sig_atomic_t ticks_left;   // until the quantum, or the watchdog period in cooperative mode, ends
+    address_t idle_sp;
+    pthread_t kernel_thread;
+    timer_t timer;
+    bool timer_created;
+    long switch_start;                  // when the pending context switch was decided, 0 if not measured
+    int traced_thread;                  // the thread whose run is open in the trace, -1 if none
+    char * shared_stack;                // the stack the shared stack threads of the worker run on, copied on switch
+    int stack_owner;                    // the thread whose frames are on the shared stack, -1 if none
+    int handoff;                        // the shared stack thread the idle context switches to next, -1 if none
+    bool parked;
+    bool signal_blocked;                // sigvtalrm blocked by the kernel for a handler that switched threads
+    char * retired_stack;               // the stack of a thread that terminated itself, released after the switch
+    // the ready descriptors a poll returns, kept off the stacks the polls run on
+    struct epoll_event io_events[MAX_IO_EVENTS];
 };
 
 // states
-std::list<int> ready_lst;
-std::list<int> blocked_lst;
-int running_thread;
+std::vector<worker*> workers;
+thread_local worker * current_worker = nullptr;
 
 // structures
-std::array<thread*, MAX_THREAD_NUM> active_threads;
+std::vector<thread*> active_threads;     // indexed by tid, grows up to MAX_THREAD_NUM with the highest tid in use
 std::map<int, int> sleeping_threads;
-std::list<int> available_id;
-sigjmp_buf env[MAX_THREAD_NUM];
+std::set<std::pair<long, int>> sleep_deadlines;
+std::map<int, int> io_fd_waiters;         // fd to the tid parked in uthread_wait_fd on it - epoll keeps one per fd
+// lowest free tid allocation - bit i of free_ids is set iff tid i is free, bit j of free_id_words iff free_ids[j]
+// has a set bit
+std::vector<uint64_t> free_ids;
+std::vector<uint64_t> free_id_words;
+int free_id_count = 0;
+std::vector<char*> free_stacks;
+std::vector<thread*> free_threads;          // recycled thread control blocks, carved out of thread_chunks
+std::vector<thread*> thread_chunks;
+std::array<sync_object*, MAX_SYNC_OBJECTS> sync_objects;
 
 // global variables
 int general_quantum = 0;
 int total_quantums = 0;
+int tick_usecs = 0;                     // period of the workers' timers, 0 while they are disarmed
+int min_thread_quantum = 0;             // the shortest quantum ever given to a thread, 0 if none
+bool adaptive_quantum = false;
+bool cooperative = false;
+scheduling_policy policy = ROUND_ROBIN;
+int watchdog_usecs = 0;
+int epoll_fd = -1;
+int io_waiters = 0;
+int wakeup_fd = -1;                     // eventfd waking the workers parked in epoll_wait
+bool wakeup_pending = false;
+int parked_workers = 0;
+long next_idle_tick = 0;                // when the idle workers count the next quantum of the sleeping threads
 struct sigaction sa = {0};
-struct itimerval timer;
-sigset_t mask_set;
 
-/* A translation is required when using an address of a variable.
-   Use this as a black box in your code. */
-address_t translate_address(address_t addr)
+// instrumentation, off by default - when off it costs a branch per state change and critical section
+bool stats_enabled = false;
+long critical_since = 0;
+long critical_nsecs = 0;
+std::array<long, LATENCY_BUCKETS> switch_latency;
+std::vector<trace_event> trace_buffer;
+size_t trace_next = 0;
+bool trace_wrapped = false;
+
+// guards all the library state above, taken for the whole critical section of mask_sigvtalrm. A ticket lock, so
+// a worker that keeps re-entering the library cannot starve the others.
+std::atomic<unsigned int> scheduler_next_ticket(0);
+std::atomic<unsigned int> scheduler_now_serving(0);
+
+/*
+ * Saves the callee-saved registers, mxcsr and the x87 control word of the running thread on its stack, stores its
+ * stack pointer in *save_sp and resumes the thread whose stack pointer is stored in *load_sp.
+ * Everything else is caller-saved by the ABI, and the signal mask is never touched.
+ */
+extern "C" void uthread_switch_context(address_t * save_sp, address_t * load_sp);
+asm(".text\n"
+    ".globl uthread_switch_context\n"
+    ".type uthread_switch_context, @function\n"
+    "uthread_switch_context:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq (%rsi), %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size uthread_switch_context, .-uthread_switch_context\n");
+
+/**
+ * the worker the caller runs on. A thread may resume on another kernel thread after any context switch, so the
+ * thread local address must never be cached across one - hence the out of line call.
+ * @return the current worker
+*/
+__attribute__((noinline)) worker * this_worker()
+{
+    asm volatile("" ::: "memory");
+    return current_worker;
+}
+
+/**
+ * monotonic time of the instrumentation
+ * @return the time in nanoseconds
+*/
+long now_nsecs()
+{
+    struct timespec now = {};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+/**
+ * takes/releases the scheduler lock
+ * @return no return
+*/
+void lock_scheduler()
+{
+    unsigned int ticket = scheduler_next_ticket.fetch_add(1, std::memory_order_relaxed);
+    int spins = 0;
+    while(scheduler_now_serving.load(std::memory_order_acquire) != ticket)
+    {
+        if(++spins < LOCK_SPINS)
+        {
+            __builtin_ia32_pause();
+        }
+        else
+        {
+            sched_yield();      // the holder may have been preempted by the kernel
+        }
+    }
+    if(stats_enabled)
+    {
+        critical_since = now_nsecs();
+    }
+}
+
+void unlock_scheduler()
+{
+    if(stats_enabled && critical_since != 0)
+    {
+        critical_nsecs += now_nsecs() - critical_since;
+    }
+    scheduler_now_serving.store(scheduler_now_serving.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+/**
+ * size of the guard below every stack. A signal frame, or the registers a lazily bound call saves, moves the stack
+ * pointer down by up to the size of the cpu's register state at once - over 11 KB with AVX-512 and AMX. A guard
+ * smaller than that is stepped over, and the frame lands in the stack mapped below it, silently corrupting another
+ * thread. So the guard covers the minimal signal stack the kernel reports, rounded up to whole pages.
+ * @return the guard size in bytes
+*/
+size_t guard_size()
+{
+    static size_t size = 0;
+    if(size == 0)
+    {
+        auto page_size = (size_t) sysconf(_SC_PAGESIZE);
+        size_t frame_size = std::max((size_t) getauxval(AT_MINSIGSTKSZ), (size_t) MINSIGSTKSZ);
+        size = std::max((size_t) STACK_GUARD_PAGES, (frame_size + page_size - 1) / page_size) * page_size;
+    }
+    return size;
+}
+
+/**
+ * size of a stack mapping - the guard followed by STACK_SIZE rounded up to whole pages
+ * @return the mapping size in bytes
+*/
+size_t stack_mapping_size()
+{
+    auto page_size = (size_t) sysconf(_SC_PAGESIZE);
+    return guard_size() + (STACK_SIZE + page_size - 1) / page_size * page_size;
+}
+
+/**
+ * grows the stack pool to at least count stacks, mapping the missing ones at once. The mapping is not reserved up
+ * front, so its pages are committed only when a thread first touches them.
+ * @return true on success, false if there is no memory
+*/
+bool reserve_stacks(size_t count)
+{
+    if(free_stacks.size() >= count)
+    {
+        return true;
+    }
+    size_t missing = count - free_stacks.size();
+    void * region = mmap(nullptr, missing * stack_mapping_size(), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if(region == MAP_FAILED)
+    {
+        return false;
+    }
+    // every stack is unmapped on its own later, a part of a mapping may be unmapped
+    for(size_t i = 0; i < missing; i++)
+    {
+        char * mapping = (char *) region + i * stack_mapping_size();
+        if(mprotect(mapping, guard_size(), PROT_NONE) < 0)
+        {
+            munmap(mapping, (missing - i) * stack_mapping_size());
+            return false;
+        }
+        free_stacks.push_back(mapping + guard_size());
+    }
+    return true;
+}
+
+/**
+ * takes a stack from the pool, mapping a new one if it is empty
+ * @return the lowest usable address of the stack, nullptr if there is no memory
+*/
+char * allocate_stack()
+{
+    if(!reserve_stacks(1))
+    {
+        return nullptr;
+    }
+    char * stack = free_stacks.back();
+    free_stacks.pop_back();
+    return stack;
+}
+
+/**
+ * returns a stack to the pool, it is recycled by the next spawn. Its pages are dropped first, so a pooled stack takes
+ * no memory until a new thread touches it again. A thread terminating itself still runs on its stack - the stack is
+ * retired then, and released by release_retired_stack once the worker switched off it.
+ * @return no return
+*/
+void release_stack(char * stack)
+{
+    char marker;
+    if(&marker >= stack && &marker < stack + STACK_SIZE)
+    {
+        this_worker()->retired_stack = stack;
+        return;
+    }
+    madvise(stack, stack_mapping_size() - guard_size(), MADV_DONTNEED);
+    free_stacks.push_back(stack);
+}
+
+/**
+ * releases the stack of the thread that terminated itself on the worker, called wherever a context switch resumes
+ * @return no return
+*/
+void release_retired_stack(worker * w)
+{
+    if(w->retired_stack != nullptr)
+    {
+        char * stack = w->retired_stack;
+        w->retired_stack = nullptr;
+        release_stack(stack);
+    }
+}
+
+/**
+ * grows the pool of thread control blocks to at least count blocks, allocating the missing ones at once
+ * @return true on success, false if there is no memory
+*/
+bool reserve_threads(size_t count)
+{
+    if(free_threads.size() >= count)
+    {
+        return true;
+    }
+    size_t missing = count - free_threads.size();
+    auto chunk = new (std::nothrow) thread[missing]();
+    if(chunk == nullptr)
+    {
+        return false;
+    }
+    thread_chunks.push_back(chunk);
+    for(size_t i = 0; i < missing; i++)
+    {
+        free_threads.push_back(&chunk[i]);
+    }
+    return true;
+}
+
+/**
+ * fills the free tid bitmaps with every tid but the main thread's
+ * @return no return
+*/
+void initialize_free_ids()
+{
+    free_ids.assign((MAX_THREAD_NUM + 63) / 64, ~0UL);
+    free_id_words.assign((free_ids.size() + 63) / 64, ~0UL);
+    if(MAX_THREAD_NUM % 64 != 0)
+    {
+        free_ids.back() = (1UL << (MAX_THREAD_NUM % 64)) - 1;
+    }
+    if(free_ids.size() % 64 != 0)
+    {
+        free_id_words.back() = (1UL << (free_ids.size() % 64)) - 1;
+    }
+    free_ids[0] &= ~1UL;
+    free_id_count = MAX_THREAD_NUM - 1;
+}
+
+/**
+ * takes the lowest free tid - a find first set in the summary word, then in the word it points to
+ * @return the tid, -1 if every tid is in use
+*/
+int allocate_id()
+{
+    for(size_t i = 0; i < free_id_words.size(); i++)
+    {
+        if(free_id_words[i] == 0)
+        {
+            continue;
+        }
+        size_t word = i * 64 + __builtin_ctzl(free_id_words[i]);
+        int tid = (int) (word * 64 + __builtin_ctzl(free_ids[word]));
+        free_ids[word] &= free_ids[word] - 1;
+        free_id_count--;
+        if(free_ids[word] == 0)
+        {
+            free_id_words[i] &= ~(1UL << (word % 64));
+        }
+        if((size_t) tid >= active_threads.size())
+        {
+            active_threads.resize(std::min<size_t>(2 * (size_t) tid + 2, MAX_THREAD_NUM), nullptr);
+        }
+        return tid;
+    }
+    return -1;
+}
+
+/**
+ * returns the tid to the free tid bitmaps
+ * @return no return
+*/
+void release_id(int tid)
+{
+    free_ids[tid / 64] |= 1UL << (tid % 64);
+    free_id_count++;
+    free_id_words[tid / 4096] |= 1UL << (tid / 64 % 64);
+}
+
+/**
+ * the thread with the given tid
+ * @return the thread, nullptr if there is no such thread
+*/
+thread * find_thread(int tid)
 {
-    address_t ret;
-    asm volatile("xor    %%fs:0x30,%0\n"
-                 "rol    $0x11,%0\n"
-            : "=g" (ret)
-            : "0" (addr));
-    return ret;
+    if(tid < 0 || (size_t) tid >= active_threads.size())
+    {
+        return nullptr;
+    }
+    return active_threads[tid];
 }
 
 /**
- * deletes thread
+ * deletes thread - its control block and stack go back to the pools, to be recycled by the next spawn
  * @return no return
 */
 void delete_thread(thread ** trd)
 {
-    if((*trd)->id != 0)
+    if((*trd)->id == 0)
+    {
+        delete *trd;
+        return;
+    }
+    if((*trd)->home_worker == -1)
+    {
+        release_stack((*trd)->stack);
+    }
+    free_threads.push_back(*trd);     // a shared stack thread keeps its saved stack buffer for the next one
+}
+
+/**
+ * deletes a sync object and the objects a channel is made of
+ * @return no return
+*/
+void delete_sync_object(sync_object * object)
+{
+    if(object->kind == CHANNEL)
     {
-        delete[] (*trd)->stack;
+        delete object->lock;
+        delete object->slots;
+        delete object->items;
     }
-    delete *trd;
+    delete object;
 }
 
 /**
- * deletes all threads
+ * deletes all threads and unmaps the pooled stacks, except for the stacks that are still running
  * @return no return
 */
 void delete_library()
@@ -75,481 +572,2747 @@ void delete_library()
     {
         if(active_thread != nullptr)
         {
+            if(active_thread->state == RUNNING && active_thread->id != 0)
+            {
+                continue;   // its stack is in use by its worker until the process exits
+            }
             delete_thread(&active_thread);
         }
     }
+    for(auto free_thread : free_threads)
+    {
+        free(free_thread->saved_stack);
+    }
+    for(auto chunk : thread_chunks)
+    {
+        delete[] chunk;
+    }
+    thread_chunks.clear();
+    free_threads.clear();
+    for(auto w : workers)
+    {
+        if(w->retired_stack != nullptr)
+        {
+            free_stacks.push_back(w->retired_stack);
+            w->retired_stack = nullptr;
+        }
+    }
+    char marker;
+    for(auto stack : free_stacks)
+    {
+        if(&marker < stack || &marker >= stack + STACK_SIZE)
+        {
+            munmap(stack - guard_size(), stack_mapping_size());
+        }
+    }
+    free_stacks.clear();
+    for(auto & object : sync_objects)
+    {
+        if(object != nullptr)
+        {
+            delete_sync_object(object);
+            object = nullptr;
+        }
+    }
+    if(epoll_fd != -1)
+    {
+        close(epoll_fd);
+        epoll_fd = -1;
+    }
+    if(wakeup_fd != -1)
+    {
+        close(wakeup_fd);
+        wakeup_fd = -1;
+    }
 }
 
 /**
- * blocks/unblocks sigvtalrm
+ * moves the thread to the given state, accounting the time it spent in the previous one
  * @return no return
 */
-void mask_sigvtalrm(int state)
+void set_state(thread * trd, thread_state state)
 {
-    if(sigprocmask(state, &mask_set, nullptr)<0)
+    if(stats_enabled)
     {
-        delete_library();
-        std::cerr<<"system error: sigprocmask error\n";
-        exit(1);
+        long now = now_nsecs();
+        trd->state_nsecs[trd->state] += now - trd->state_since;
+        trd->state_since = now;
     }
+    trd->state = state;
 }
 
 /**
- * sets quantum to the given time
+ * appends an event to the trace ring buffer, overwriting the oldest one once it is full
  * @return no return
 */
-void set_quantum()
+void record_trace(worker * w, int tid, char phase, bool voluntary)
 {
-    // Configure the timer to expire after general_quantum sec... */
-    timer.it_value.tv_sec = general_quantum/1000000;        // first time interval, seconds part
-    timer.it_value.tv_usec = general_quantum%1000000;        // first time interval, microseconds part
-    timer.it_interval.tv_sec = 0;    // following time intervals, seconds part
-    timer.it_interval.tv_usec = 0;    // following time intervals, microseconds part
-    if (setitimer(ITIMER_VIRTUAL, &timer, nullptr))
+    trace_buffer[trace_next] = {now_nsecs(), w->id, tid, phase, voluntary};
+    if(++trace_next == trace_buffer.size())
     {
-        delete_library();
-        std::cerr<<"system error: setitimer error\n";
-        exit(1);
+        trace_next = 0;
+        trace_wrapped = true;
     }
 }
 
 /**
- * creates new thread
- * @return new thread
+ * adds the latency of the context switch that resumed the caller to the histogram
+ * @return no return
 */
-thread * setup_thread(thread_entry_point entry_point, int tid)
+void record_switch_latency()
 {
-    char * stack = new (std::nothrow) char [STACK_SIZE];
-    if(stack == nullptr)
+    worker * w = this_worker();
+    if(!stats_enabled || w->switch_start == 0)
     {
-        delete_library();
-        std::cerr<<"system error: no memory space\n";
-        exit(1);
+        return;
+    }
+    auto latency = (unsigned long) (now_nsecs() - w->switch_start);
+    int bucket = std::min(63 - __builtin_clzl(latency | 1), LATENCY_BUCKETS - 1);
+    switch_latency[bucket]++;
+    w->switch_start = 0;
+}
+
+void preempt_running_thread(bool voluntary);
+
+/**
+ * marks the worker the caller runs on as in a critical section. A preemption between reading the worker and
+ * marking it may resume the thread on another worker, so the mark is checked and, if it hit the old worker, undone.
+ * @return no return
+*/
+void enter_critical_section()
+{
+    for(;;)
+    {
+        worker * w = this_worker();
+        w->in_critical.fetch_add(1);
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        if(this_worker() == w)
+        {
+            return;
+        }
+        w->in_critical.fetch_sub(1);
     }
-    address_t sp = (address_t) stack + STACK_SIZE - sizeof(address_t);
-    auto pc = (address_t) entry_point;
-    sigsetjmp(env[tid], 1);
-    (env[tid]->__jmpbuf)[JB_SP] = translate_address(sp);
-    (env[tid]->__jmpbuf)[JB_PC] = translate_address(pc);
-    if(sigemptyset(&env[tid]->__saved_mask)<0)
+}
+
+/**
+ * blocks or unblocks sigvtalrm in the kernel for the calling worker
+ * @return no return
+*/
+void set_signal_blocked(worker * w, bool blocked)
+{
+    sigset_t vtalrm;
+    sigemptyset(&vtalrm);
+    sigaddset(&vtalrm, SIGVTALRM);
+    pthread_sigmask(blocked ? SIG_BLOCK : SIG_UNBLOCK, &vtalrm, nullptr);
+    w->signal_blocked = blocked;
+}
+
+/**
+ * leaves the critical section, carrying out the preemption deferred in it. The kernel blocks sigvtalrm while its
+ * handler runs - a thread the handler switched to unblocks it here, unless it is itself in the handler, where a
+ * second signal frame would not fit on its stack. That one gets it unblocked by its sigreturn.
+ * @return no return
+*/
+void leave_critical_section(bool in_signal_handler)
+{
+    for(;;)
     {
-        delete_library();
-        std::cerr<<"system error: sigemptyset error\n";
-        exit(1);
+        worker * w = this_worker();
+        while(w->preempt_pending)
+        {
+            w->preempt_pending = 0;
+            preempt_running_thread(false);
+            w = this_worker();
+        }
+        unlock_scheduler();
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        w->in_critical.fetch_sub(1);
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        if(w->signal_blocked && !in_signal_handler)
+        {
+            set_signal_blocked(w, false);
+        }
+        // out of the critical section the thread may be preempted and resumed on another worker at any point
+        if(!this_worker()->preempt_pending)
+        {
+            return;
+        }
+        // the signal arrived between the check and leaving the critical section
+        enter_critical_section();
+        lock_scheduler();
+    }
+}
+
+/**
+ * blocks/unblocks sigvtalrm without a syscall - while blocked, the preemption is deferred and carried out on unblock.
+ * Blocking also takes the scheduler lock, which is handed over with the context switches made while it is held.
+ * @return no return
+*/
+void mask_sigvtalrm(int state)
+{
+    if(state == SIG_BLOCK)
+    {
+        enter_critical_section();
+        lock_scheduler();
+        return;
+    }
+    leave_critical_section(false);
+}
+
+/**
+ * length of the ticks of the workers' timers - a fraction of the shortest quantum that may be in use, or of the
+ * watchdog period in cooperative mode
+ * @return the length in micro-seconds, 0 if the timers are not needed
+*/
+int tick_length()
+{
+    int shortest = general_quantum;
+    if(min_thread_quantum != 0)
+    {
+        shortest = std::min(shortest, min_thread_quantum);
+    }
+    if(adaptive_quantum)
+    {
+        shortest = std::min(shortest, general_quantum >> ADAPTIVE_MIN_SHIFT);
     }
-    auto new_thread = new  (std::nothrow) thread;
-    if(new_thread == nullptr)
+    if(cooperative)
+    {
+        shortest = watchdog_usecs;
+    }
+    if(shortest == 0)
+    {
+        return 0;
+    }
+    return std::max(shortest / TICKS_PER_QUANTUM, MIN_TICK_USECS);
+}
+
+/**
+ * arms the periodic timer of the worker with the current tick length, a zero length disarms it
+ * @return no return
+*/
+void arm_timer(worker * w)
+{
+    struct itimerspec spec = {};
+    spec.it_value.tv_sec = tick_usecs/1000000;
+    spec.it_value.tv_nsec = (tick_usecs%1000000) * 1000L;
+    spec.it_interval = spec.it_value;
+    if(timer_settime(w->timer, 0, &spec, nullptr) < 0)
     {
         delete_library();
-        std::cerr<<"system error: no memory space\n";
+        std::cerr<<"system error: timer_settime error\n";
         exit(1);
     }
-    new_thread->id=tid;
-    new_thread->stack=stack;
-    new_thread->thread_quantums=0;
-    return new_thread;
 }
 
 /**
- * update quantums of slepping threads
- * @return no return
+ * re-arms the timers of all the workers if the tick length changed
+ * @return no return
+*/
+void update_tick()
+{
+    int length = tick_length();
+    if(length == tick_usecs)
+    {
+        return;
+    }
+    tick_usecs = length;
+    for(auto w : workers)
+    {
+        if(w->timer_created)
+        {
+            arm_timer(w);
+        }
+    }
+}
+
+/**
+ * starts the quantum of the worker's running thread - the signal handler counts it down in ticks, so no timer is
+ * touched. Under the adaptive quantum a thread with the general quantum gets a longer one for every quantum it ran
+ * out in a row, and a shorter one while many threads wait on the worker.
+ * @return no return
+*/
+void set_quantum(worker * w)
+{
+    if(tick_usecs == 0)
+    {
+        w->ticks_left = INT_MAX;
+        return;
+    }
+    thread * trd = active_threads[w->running_thread];
+    long quantum = cooperative ? watchdog_usecs : trd->quantum_usecs;
+    if(quantum == 0)
+    {
+        quantum = general_quantum;
+        if(adaptive_quantum)
+        {
+            quantum <<= trd->quantum_level;
+            if(w->ready_lst.size > ADAPTIVE_CROWD)
+            {
+                quantum = std::max(quantum * ADAPTIVE_CROWD / (long) w->ready_lst.size,
+                                   (long) general_quantum >> ADAPTIVE_MIN_SHIFT);
+            }
+        }
+    }
+    w->ticks_left = (int) std::max(1L, std::min((quantum + tick_usecs / 2) / tick_usecs, (long) INT_MAX));
+}
+
+/**
+ * first code a new thread runs - it is entered from a context switch, so it leaves the critical section itself
+ * @return no return
+*/
+void thread_entry_trampoline()
+{
+    release_retired_stack(this_worker());
+    record_switch_latency();
+    thread_entry_point entry_point = active_threads[uthread_get_tid()]->entry_point;
+    mask_sigvtalrm(SIG_UNBLOCK);
+    entry_point();
+    uthread_terminate(uthread_get_tid());
+}
+
+/**
+ * builds the frame uthread_switch_context pops when the context is first switched to, right below top
+ * @return the initial stack pointer
+*/
+address_t initialize_frame(address_t * top, void (*start_routine)())
+{
+    *--top = 0;                                         // return address of the start routine, never used
+    *--top = (address_t) start_routine;                 // popped by the ret of uthread_switch_context
+    for(int i = 0; i < 6; i++)
+    {
+        *--top = 0;                                     // rbp, rbx, r12-r15
+    }
+    *--top = INITIAL_FP_STATE;
+    return (address_t) top;
+}
+
+/**
+ * the top of the stack, aligned as the ABI requires
+ * @return the address
+*/
+address_t stack_top(char * stack)
+{
+    return ((address_t) stack + STACK_SIZE) & ~(address_t) 15;
+}
+
+/**
+ * builds the initial frame at the top of the stack
+ * @return the initial stack pointer
+*/
+address_t initialize_stack(char * stack, void (*start_routine)())
+{
+    return initialize_frame((address_t *) stack_top(stack), start_routine);
+}
+
+/**
+ * grows the buffer the stack image of a shared stack thread is saved in
+ * @return no return
+*/
+void reserve_saved_stack(thread * trd, size_t size)
+{
+    if(trd->saved_capacity >= size)
+    {
+        return;
+    }
+    size_t capacity = std::max(size, 2 * trd->saved_capacity);
+    auto saved_stack = (char *) realloc(trd->saved_stack, capacity);
+    if(saved_stack == nullptr)
+    {
+        delete_library();
+        std::cerr<<"system error: no memory space\n";
+        exit(1);
+    }
+    trd->saved_stack = saved_stack;
+    trd->saved_capacity = capacity;
+}
+
+/**
+ * pins a new thread to the current worker and builds its initial frame as its saved stack image. The worker's
+ * shared stack is mapped on the first such thread.
+ * @return no return
+*/
+void initialize_shared_stack(thread * trd)
+{
+    worker * w = this_worker();
+    if(w->shared_stack == nullptr)
+    {
+        w->shared_stack = allocate_stack();
+        if(w->shared_stack == nullptr)
+        {
+            delete_library();
+            std::cerr<<"system error: no memory space\n";
+            exit(1);
+        }
+    }
+    reserve_saved_stack(trd, INITIAL_FRAME_SIZE);
+    initialize_frame((address_t *) (trd->saved_stack + INITIAL_FRAME_SIZE), &thread_entry_trampoline);
+    trd->home_worker = w->id;
+    trd->saved_size = INITIAL_FRAME_SIZE;
+    trd->sp = stack_top(w->shared_stack) - INITIAL_FRAME_SIZE;
+}
+
+/**
+ * creates new thread
+ * @return new thread
+*/
+thread * setup_thread(thread_entry_point entry_point, int tid, bool shared_stack)
+{
+    char * stack = shared_stack ? nullptr : allocate_stack();
+    if(!shared_stack && stack == nullptr)
+    {
+        delete_library();
+        std::cerr<<"system error: no memory space\n";
+        exit(1);
+    }
+    if(!reserve_threads(1))
+    {
+        release_stack(stack);
+        delete_library();
+        std::cerr<<"system error: no memory space\n";
+        exit(1);
+    }
+    thread * new_thread = free_threads.back();
+    free_threads.pop_back();
+    new_thread->id=tid;
+    new_thread->stack=stack;
+    new_thread->thread_quantums=0;
+    new_thread->home_worker=-1;
+    new_thread->saved_size=0;
+    if(shared_stack)
+    {
+        initialize_shared_stack(new_thread);
+    }
+    else
+    {
+        new_thread->sp=initialize_stack(stack, &thread_entry_trampoline);
+    }
+    new_thread->entry_point=entry_point;
+    new_thread->state=WAITING;
+    new_thread->blocked=false;
+    new_thread->io_waiting=false;
+    new_thread->io_fd=-1;
+    new_thread->io_events=0;
+    new_thread->sleep_deadline=0;
+    new_thread->sync_waiting=false;
+    new_thread->wait_object=nullptr;
+    std::fill(new_thread->state_nsecs, new_thread->state_nsecs + THREAD_STATES, 0);
+    new_thread->state_since=stats_enabled ? now_nsecs() : 0;
+    new_thread->voluntary_switches=0;
+    new_thread->preemptive_switches=0;
+    new_thread->terminated=false;
+    new_thread->worker=0;
+    new_thread->priority=DEFAULT_PRIORITY;
+    new_thread->quantum_usecs=0;
+    new_thread->quantum_level=0;
+    new_thread->vruntime=0;
+    new_thread->in_signal_handler=false;
+    return new_thread;
+}
+
+/**
+ * releases the thread's tid and resources
+ * @return no return
+*/
+void free_thread(int tid)
+{
+    thread * trd = active_threads[tid];
+    if(trd->io_waiting)
+    {
+        // its tid must not be reported by the poller once it is reused
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, trd->io_fd, nullptr);
+        io_fd_waiters.erase(trd->io_fd);
+        io_waiters--;
+    }
+    if(trd->sync_waiting)
+    {
+        sync_object * object = trd->wait_object;
+        object->waiters.erase(trd->wait_it);
+        // undo the count of the waiter
+        if(object->kind == SEMAPHORE)
+        {
+            object->value.fetch_add(1, std::memory_order_relaxed);
+        }
+        else if(object->kind == CONDITION)
+        {
+            object->value.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+    if(trd->home_worker != -1 && workers[trd->home_worker]->stack_owner == tid)
+    {
+        workers[trd->home_worker]->stack_owner = -1;   // its frames are dead, nothing to save
+    }
+    sleeping_threads.erase(tid);
+    sleep_deadlines.erase(std::make_pair(trd->sleep_deadline, tid));
+    release_id(tid);
+    delete_thread(&active_threads[tid]);
+    active_threads[tid] = nullptr;
+}
+
+/**
+ * fair policy weight of a priority level
+ * @return the weight
+*/
+long priority_weight(int priority)
+{
+    if(priority <= DEFAULT_PRIORITY)
+    {
+        return (long) DEFAULT_WEIGHT << (DEFAULT_PRIORITY - priority);
+    }
+    return (long) DEFAULT_WEIGHT >> (priority - DEFAULT_PRIORITY);
+}
+
+/**
+ * inserts the thread into the ready queue according to the policy
+ * @return no return
+*/
+void push_ready(ready_queue * queue, int tid)
+{
+    thread * trd = active_threads[tid];
+    switch(policy)
+    {
+        case ROUND_ROBIN:
+            trd->ready_it = queue->fifo.insert(queue->fifo.end(), tid);
+            break;
+        case STRICT_PRIORITY:
+            trd->ready_it = queue->levels[trd->priority].insert(queue->levels[trd->priority].end(), tid);
+            queue->level_mask |= 1U << trd->priority;
+            break;
+        case WEIGHTED_FAIR:
+            // a thread that was waiting does not get to catch up on the quantums it missed
+            trd->vruntime = std::max(trd->vruntime, queue->min_vruntime);
+            queue->fair.insert(std::make_pair(trd->vruntime, tid));
+            break;
+    }
+    queue->size++;
+    if(trd->home_worker != -1)
+    {
+        queue->pinned++;
+    }
+}
+
+/**
+ * removes the given READY thread from the ready queue
+ * @return no return
+*/
+void erase_ready(ready_queue * queue, int tid)
+{
+    thread * trd = active_threads[tid];
+    switch(policy)
+    {
+        case ROUND_ROBIN:
+            queue->fifo.erase(trd->ready_it);
+            break;
+        case STRICT_PRIORITY:
+            queue->levels[trd->priority].erase(trd->ready_it);
+            if(queue->levels[trd->priority].empty())
+            {
+                queue->level_mask &= ~(1U << trd->priority);
+            }
+            break;
+        case WEIGHTED_FAIR:
+            queue->fair.erase(std::make_pair(trd->vruntime, tid));
+            break;
+    }
+    queue->size--;
+    if(trd->home_worker != -1)
+    {
+        queue->pinned--;
+    }
+}
+
+/**
+ * takes the thread the policy runs first - the head of the list, the head of the most urgent level, or the least
+ * vruntime. Stealing takes the thread it would run last instead.
+ * @return the tid, the queue must not be empty
+*/
+int pop_ready(ready_queue * queue, bool steal)
+{
+    int tid = 0;
+    switch(policy)
+    {
+        case ROUND_ROBIN:
+            tid = steal ? queue->fifo.back() : queue->fifo.front();
+            break;
+        case STRICT_PRIORITY:
+        {
+            int level = steal ? 31 - __builtin_clz(queue->level_mask) : __builtin_ctz(queue->level_mask);
+            tid = steal ? queue->levels[level].back() : queue->levels[level].front();
+            break;
+        }
+        case WEIGHTED_FAIR:
+            tid = steal ? queue->fair.rbegin()->second : queue->fair.begin()->second;
+            if(!steal)
+            {
+                queue->min_vruntime = std::max(queue->min_vruntime, queue->fair.begin()->first);
+            }
+            break;
+    }
+    erase_ready(queue, tid);
+    return tid;
+}
+
+/**
+ * wakes a worker parked in the idle loop, so it can take a READY thread
+ * @return no return
+*/
+void wake_parked_worker()
+{
+    if(wakeup_pending)
+    {
+        return;
+    }
+    uint64_t one = 1;
+    if(write(wakeup_fd, &one, sizeof(one)) == sizeof(one))
+    {
+        wakeup_pending = true;
+    }
+}
+
+/**
+ * interrupts the given worker if it is parked, so that it runs the shared stack thread made READY on its list
+ * @return no return
+*/
+void wake_worker(worker * w)
+{
+    if(w->parked)
+    {
+        pthread_kill(w->kernel_thread, SIGVTALRM);
+    }
+}
+
+/**
+ * pushes the thread to the end of the current worker's ready list, or of its own worker's for a shared stack thread
+ * @return no return
+*/
+void make_ready(int tid)
+{
+    thread * trd = active_threads[tid];
+    worker * w = trd->home_worker == -1 ? this_worker() : workers[trd->home_worker];
+    set_state(trd, READY);
+    trd->worker = w->id;
+    push_ready(&w->ready_lst, tid);
+    if(w != this_worker())
+    {
+        wake_worker(w);
+    }
+    // a thread requeued by its own worker is picked again right away unless others are READY too
+    else if(parked_workers > 0 && (tid != w->running_thread || w->ready_lst.size > 1))
+    {
+        wake_parked_worker();
+    }
+    // under strict priority a more urgent thread takes the cpu as soon as the critical section ends
+    if(policy == STRICT_PRIORITY && w->running_thread != -1 && w->running_thread != tid &&
+       trd->priority < active_threads[w->running_thread]->priority)
+    {
+        w->preempt_pending = 1;
+    }
+}
+
+/**
+ * removes a READY thread from the ready list holding it
+ * @return no return
+*/
+void remove_from_ready(int tid)
+{
+    thread * trd = active_threads[tid];
+    erase_ready(&workers[trd->worker]->ready_lst, tid);
+    set_state(trd, WAITING);
+}
+
+/**
+ * makes a WAITING thread READY once it is neither blocked nor sleeping
+ * @return no return
+*/
+void wake_thread(int tid)
+{
+    thread * trd = active_threads[tid];
+    if(trd->state == WAITING && !trd->terminated && !trd->blocked && !trd->io_waiting && !trd->sync_waiting && trd->sleep_deadline == 0 &&
+       sleeping_threads.find(tid) == sleeping_threads.end())
+    {
+        make_ready(tid);
+    }
+}
+
+/**
+ * update quantums of slepping threads
+ * @return no return
+*/
+void update_sleeping_thread()
+{
+    auto it = sleeping_threads.begin();
+    while (it != sleeping_threads.end())
+    {
+        (*it).second--;
+        if((*it).second <= 0)
+        {
+            int tid = (*it).first;
+            it = sleeping_threads.erase(it);
+            wake_thread(tid);
+        }
+        else{++it;}
+    }
+}
+
+/**
+ * wakes the threads whose uthread_sleep_usecs deadline has passed
+ * @return no return
+*/
+void wake_due_sleepers()
+{
+    if(sleep_deadlines.empty())
+    {
+        return;
+    }
+    long now = now_nsecs();
+    while(!sleep_deadlines.empty() && sleep_deadlines.begin()->first <= now)
+    {
+        int tid = sleep_deadlines.begin()->second;
+        sleep_deadlines.erase(sleep_deadlines.begin());
+        active_threads[tid]->sleep_deadline = 0;
+        wake_thread(tid);
+    }
+}
+
+/**
+ * wakes the threads parked on the ready file descriptors, and consumes the wakeup of the parked workers
+ * @return no return
+*/
+void handle_io_events(struct epoll_event * events, int ready)
+{
+    for(int i = 0; i < ready; i++)
+    {
+        if(events[i].data.u32 == WAKEUP_EVENT)
+        {
+            uint64_t count;
+            if(read(wakeup_fd, &count, sizeof(count)) == sizeof(count))
+            {
+                wakeup_pending = false;
+            }
+            continue;
+        }
+        int tid = (int) events[i].data.u32;
+        thread * trd = active_threads[tid];
+        if(trd == nullptr || !trd->io_waiting)
+        {
+            continue;
+        }
+        trd->io_waiting = false;
+        trd->io_events = (int) events[i].events;
+        io_fd_waiters.erase(trd->io_fd);
+        io_waiters--;
+        wake_thread(tid);
+    }
+}
+
+/**
+ * collects the file descriptors that became ready without waiting, and wakes the threads parked on them
+ * @return no return
+*/
+void poll_io()
+{
+    if(io_waiters == 0)
+    {
+        return;
+    }
+    worker * w = this_worker();
+    int ready = epoll_wait(epoll_fd, w->io_events, MAX_IO_EVENTS, 0);
+    handle_io_events(w->io_events, ready);
+}
+
+/**
+ * takes the next thread from the worker's own ready list, or steals the last one of the longest ready list
+ * @return the tid of the next thread, -1 if no thread is READY
+*/
+int pick_next_thread(worker * w)
+{
+    worker * victim = w;
+    if(w->ready_lst.size == 0)
+    {
+        size_t most = 0;
+        for(auto other : workers)
+        {
+            if(other->ready_lst.size - other->ready_lst.pinned > most)
+            {
+                victim = other;
+                most = other->ready_lst.size - other->ready_lst.pinned;
+            }
+        }
+        if(most == 0)
+        {
+            return -1;
+        }
+        // shared stack threads are skipped, and put back in their place
+        std::vector<int> pinned;
+        int tid = pop_ready(&victim->ready_lst, true);
+        while(active_threads[tid]->home_worker != -1)
+        {
+            pinned.push_back(tid);
+            tid = pop_ready(&victim->ready_lst, true);
+        }
+        for(auto it = pinned.rbegin(); it != pinned.rend(); ++it)
+        {
+            push_ready(&victim->ready_lst, *it);
+        }
+        // vruntimes are relative to the queue that holds the thread
+        active_threads[tid]->vruntime += w->ready_lst.min_vruntime - victim->ready_lst.min_vruntime;
+        return tid;
+    }
+    return pop_ready(&w->ready_lst, false);
+}
+
+/**
+ * makes the thread the RUNNING thread of the worker and starts its quantum
+ * @return no return
+*/
+void start_quantum(worker * w, int tid)
+{
+    thread * trd = active_threads[tid];
+    w->running_thread = tid;
+    w->running = trd;
+    set_state(trd, RUNNING);
+    trd->worker = w->id;
+    trd->thread_quantums++;
+    if(policy == WEIGHTED_FAIR)
+    {
+        trd->vruntime += VRUNTIME_PER_QUANTUM / priority_weight(trd->priority);
+    }
+    total_quantums++;
+    w->quantums++;
+    if(!trace_buffer.empty())
+    {
+        record_trace(w, tid, 'B', false);
+        w->traced_thread = tid;
+    }
+    update_sleeping_thread();
+    set_quantum(w);
+}
+
+/**
+ * saves the frames of the shared stack's owner to its buffer, and restores the frames of the given thread
+ * @return no return
+*/
+void swap_shared_stack(worker * w, int tid)
+{
+    address_t top = stack_top(w->shared_stack);
+    if(w->stack_owner != -1)
+    {
+        thread * owner = active_threads[w->stack_owner];
+        reserve_saved_stack(owner, top - owner->sp);
+        owner->saved_size = top - owner->sp;
+        memcpy(owner->saved_stack, (char *) owner->sp, owner->saved_size);
+    }
+    thread * trd = active_threads[tid];
+    memcpy((char *) (top - trd->saved_size), trd->saved_stack, trd->saved_size);
+    w->stack_owner = tid;
+}
+
+/**
+ * switches to the thread - with sigvtalrm blocked if it resumes in the signal handler, whose frame leaves no room on
+ * its stack for another
+ * @return no return
+*/
+void resume_thread(worker * w, address_t * save_sp, thread * trd)
+{
+    if(trd->in_signal_handler && !w->signal_blocked)
+    {
+        set_signal_blocked(w, true);
+    }
+    uthread_switch_context(save_sp, &trd->sp);
+}
+
+/**
+ * switches to the given thread. The frames of a shared stack thread are restored first, unless they are still on
+ * the shared stack - which cannot be overwritten while running on it, so then the idle context does it.
+ * @return no return
+*/
+void switch_to(worker * w, address_t * save_sp, int next)
+{
+    thread * trd = active_threads[next];
+    if(trd->home_worker != -1 && w->stack_owner != next)
+    {
+        char marker;
+        if(&marker >= w->shared_stack && &marker < w->shared_stack + STACK_SIZE)
+        {
+            w->handoff = next;
+            uthread_switch_context(save_sp, &w->idle_sp);
+            return;
+        }
+        swap_shared_stack(w, next);
+    }
+    resume_thread(w, save_sp, trd);
+}
+
+/**
+ * switching running threads, voluntary unless the running thread is preempted
+ * @return no return
+*/
+void context_switching_helper(bool voluntary)
+{
+    // running thread already moved to ready/waiting state or been terminated!
+    worker * w = this_worker();
+    address_t terminated_sp;
+    address_t * save_sp = &terminated_sp;
+    if(stats_enabled)
+    {
+        w->switch_start = now_nsecs();
+    }
+    if(w->traced_thread != -1)
+    {
+        record_trace(w, w->traced_thread, 'E', voluntary);
+        w->traced_thread = -1;
+    }
+    if(w->running_thread != -1 && w->running->terminated)
+    {
+        // terminated by another worker while in a critical section, then it parked itself - release it now, or it
+        // would wait with its tid, stack and control block until woken up again
+        free_thread(w->running_thread);
+        w->running_thread = -1;
+        w->running = nullptr;
+    }
+    if(w->running_thread != -1)
+    {
+        thread * trd = active_threads[w->running_thread];
+        save_sp = &trd->sp; /* saves running thread context before removal*/
+        if(stats_enabled)
+        {
+            (voluntary ? trd->voluntary_switches : trd->preemptive_switches)++;
+        }
+        if(voluntary)
+        {
+            trd->quantum_level = 0;
+        }
+        else if(w->ticks_left <= 0)
+        {
+            trd->quantum_level = std::min(trd->quantum_level + 1, ADAPTIVE_MAX_LEVEL);
+        }
+    }
+    poll_io();
+    wake_due_sleepers();
+    int next = pick_next_thread(w);
+    // this switch carries out any preemption still pending - left set, it would preempt the next thread
+    w->preempt_pending = 0;
+    if(next == -1)
+    {
+        // nothing to run - park the worker in its idle loop until a thread becomes ready
+        w->running_thread = -1;
+        w->running = nullptr;
+        uthread_switch_context(save_sp, &w->idle_sp);
+        release_retired_stack(this_worker());
+        record_switch_latency();
+        return;
+    }
+    start_quantum(w, next);
+    // returns once the switched out thread is scheduled again
+    switch_to(w, save_sp, next);
+    release_retired_stack(this_worker());
+    record_switch_latency();
+}
+
+/**
+ * takes the running thread off the current worker - back to the ready list, or out of the scheduler if another
+ * worker blocked or terminated it meanwhile - and makes a scheduling decision
+ * @return no return
+*/
+void preempt_running_thread(bool voluntary)
+{
+    int tid = this_worker()->running_thread;
+    thread * trd = active_threads[tid];
+    if(trd->terminated)
+    {
+        free_thread(tid);
+        this_worker()->running_thread = -1;
+        this_worker()->running = nullptr;
+    }
+    else if(trd->blocked)
+    {
+        set_state(trd, WAITING);
+    }
+    else
+    {
+        make_ready(tid);
+    }
+    context_switching_helper(voluntary);
+}
+
+/**
+ * interrupts the worker running the thread, so it switches it out at once
+ * @return no return
+*/
+void kick_worker(int tid)
+{
+    pthread_kill(workers[active_threads[tid]->worker]->kernel_thread, SIGVTALRM);
+}
+
+/**
+ * reports a thread that exceeded the watchdog quantum. Called from the signal handler, so the message is formatted
+ * by hand and written with write(2) - iostreams and printf are not async-signal-safe.
+ * @return no return
+*/
+void report_watchdog(int tid)
+{
+    static const char prefix[] = "thread library error: thread ";
+    static const char suffix[] = " exceeded the watchdog quantum\n";
+    char message[sizeof(prefix) + sizeof(suffix) + 12];
+    char digits[12];
+    int n = 0;
+    do
+    {
+        digits[n++] = '0' + tid % 10;
+        tid /= 10;
+    } while(tid > 0);
+    size_t length = sizeof(prefix) - 1;
+    memcpy(message, prefix, length);
+    while(n > 0)
+    {
+        message[length++] = digits[--n];
+    }
+    memcpy(message + length, suffix, sizeof(suffix) - 1);
+    length += sizeof(suffix) - 1;
+    int saved_errno = errno;
+    ssize_t written = write(STDERR_FILENO, message, length);
+    (void) written;
+    errno = saved_errno;
+}
+
+/**
+ * pushes the running thread to end of ready list and doing a context switch
+ * @return no return
+*/
+void context_switching(int sig)
+{
+    worker * w = this_worker();
+    // active_threads may be reallocated by another worker meanwhile - control blocks are pooled, never freed
+    thread * trd = w == nullptr ? nullptr : w->running;
+    if(trd == nullptr)
+    {
+        return;
+    }
+    if(!trd->blocked && !trd->terminated)
+    {
+        // a tick - only a thread that ran out its quantum, or the whole watchdog period, is preempted. The kernel
+        // may deliver several expirations as one signal, the overrun counts the rest.
+        w->ticks_left -= 1 + std::max(timer_getoverrun(w->timer), 0);
+        if(w->ticks_left > 0)
+        {
+            return;
+        }
+        if(cooperative)
+        {
+            report_watchdog(trd->id);
+        }
+    }
+    if(w->in_critical)
+    {
+        w->preempt_pending = 1;
+        return;
+    }
+    mask_sigvtalrm(SIG_BLOCK);
+    trd->in_signal_handler = true;
+    w->signal_blocked = true;
+    preempt_running_thread(false);
+    leave_critical_section(true);
+    // resumed with sigvtalrm still blocked - the return restores the mask it was preempted with
+    trd->in_signal_handler = false;
+    this_worker()->signal_blocked = false;
+}
+
+/**
+ * how long an idle worker may park - until the next idle quantum of the sleeping threads, while no worker runs a
+ * thread, or until the earliest sleep deadline
+ * @return the timeout of epoll_wait in milliseconds, -1 to park until woken
+*/
+int idle_timeout()
+{
+    long now = now_nsecs();
+    long until = -1;
+    bool all_idle = true;
+    for(auto w : workers)
+    {
+        all_idle = all_idle && w->running_thread == -1;
+    }
+    if(!sleeping_threads.empty() && all_idle)
+    {
+        if(next_idle_tick == 0)
+        {
+            next_idle_tick = now + general_quantum * 1000L;
+        }
+        until = std::max(next_idle_tick - now, 0L);
+    }
+    else
+    {
+        next_idle_tick = 0;
+    }
+    if(!sleep_deadlines.empty())
+    {
+        long deadline = std::max(sleep_deadlines.begin()->first - now, 0L);
+        until = until == -1 ? deadline : std::min(until, deadline);
+    }
+    return until == -1 ? -1 : (int) ((until + 999999) / 1000000);
+}
+
+/**
+ * counts a quantum for the sleeping threads once a whole quantum passed with every worker idle, since no quantum
+ * starts meanwhile
+ * @return no return
+*/
+void idle_tick()
+{
+    if(next_idle_tick != 0 && now_nsecs() >= next_idle_tick)
+    {
+        next_idle_tick += general_quantum * 1000L;
+        update_sleeping_thread();
+    }
+}
+
+/**
+ * runs on the worker's own stack whenever it has no thread to run. Entered in a critical section, holding the
+ * scheduler lock. A worker with nothing to run parks in epoll_wait, so an idle process uses no cpu - it is woken
+ * by a thread made READY, a ready file descriptor or the next sleeper that is due.
+ * @return no return
+*/
+void worker_idle_loop()
+{
+    for(;;)
+    {
+        worker * w = this_worker();
+        release_retired_stack(w);
+        if(w->handoff != -1)
+        {
+            int next = w->handoff;
+            w->handoff = -1;
+            swap_shared_stack(w, next);
+            resume_thread(w, &w->idle_sp, active_threads[next]);
+            continue;
+        }
+        poll_io();
+        wake_due_sleepers();
+        idle_tick();
+        int next = pick_next_thread(w);
+        if(next != -1)
+        {
+            w->preempt_pending = 0;
+            if(stats_enabled)
+            {
+                w->switch_start = now_nsecs();
+            }
+            start_quantum(w, next);
+            // more READY threads than this worker takes - pass the wakeup on to another parked worker
+            if(parked_workers > 0 && w->ready_lst.size > 0)
+            {
+                wake_parked_worker();
+            }
+            switch_to(w, &w->idle_sp, next);
+            continue;
+        }
+        int timeout = idle_timeout();
+        parked_workers++;
+        w->parked = true;
+        // sigvtalrm from wake_worker stays pending until epoll_pwait unblocks it, so it cannot be missed
+        sigset_t vtalrm, unmasked;
+        sigemptyset(&vtalrm);
+        sigaddset(&vtalrm, SIGVTALRM);
+        pthread_sigmask(SIG_BLOCK, &vtalrm, &unmasked);
+        sigdelset(&unmasked, SIGVTALRM);
+        unlock_scheduler();
+        int ready = epoll_pwait(epoll_fd, w->io_events, MAX_IO_EVENTS, timeout, &unmasked);
+        lock_scheduler();
+        pthread_sigmask(SIG_SETMASK, &unmasked, nullptr);
+        w->signal_blocked = false;
+        w->parked = false;
+        parked_workers--;
+        handle_io_events(w->io_events, ready);
+    }
+}
+
+/**
+ * creates and arms the worker's periodic thread cpu time timer, which delivers sigvtalrm to the worker's kernel
+ * thread only. It is armed once, and re-armed only when the tick length changes.
+ * @return no return
+*/
+void initialize_worker_timer(worker * w)
+{
+    struct sigevent event = {};
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGVTALRM;
+    event._sigev_un._tid = (pid_t) syscall(SYS_gettid);
+    if(timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &w->timer) < 0)
+    {
+        std::cerr<<"system error: timer_create error\n";
+        exit(1);
+    }
+    w->timer_created = true;
+    arm_timer(w);
+}
+
+/**
+ * entry point of the additional kernel threads
+ * @return no return
+*/
+void * worker_main(void * arg)
+{
+    current_worker = (worker *) arg;
+    current_worker->in_critical.fetch_add(1);
+    lock_scheduler();
+    initialize_worker_timer(current_worker);     // under the lock, so no tick length change is missed
+    worker_idle_loop();
+    return nullptr;
+}
+
+/**
+ * initialize timer
+ * @return no return
+*/
+void initialize_timer()
+{
+    sa.sa_handler = &context_switching;
+    // blocked by the kernel while the handler runs, so signal frames do not nest on the small thread stacks. The
+    // handler may switch to another thread without returning - leave_critical_section unblocks it then.
+    sa.sa_flags = 0;
+    if (sigaction(SIGVTALRM, &sa, nullptr) < 0)
+    {
+        std::cerr<<"system error: sigaction error\n";
+        exit(1);
+    }
+}
+
+/**
+ * makes a first call of the libc functions the scheduler calls on the threads' stacks, with arguments they reject,
+ * and of the out of line parts of the containers it uses, so that they are bound while on the caller's stack.
+ * Binding a lazily bound function saves the vector registers on the stack - several KB on cpus with wide registers,
+ * more than a STACK_SIZE stack has to spare.
+ * @return no return
+*/
+void bind_library_calls()
+{
+    std::list<int> list = {0, 1, 2};
+    list.erase(std::next(list.begin()));
+    list.pop_front();
+    std::set<int> set = {0, 1, 2, 3};
+    set.erase(std::prev(set.end()));
+    set.erase(set.begin());
+    std::map<int, int> map = {{0, 0}, {1, 1}};
+    for(int value : set)
+    {
+        map[value]++;
+    }
+    std::prev(map.end())->second++;
+    for(auto & entry : map)
+    {
+        entry.second++;
+    }
+    delete[] new (std::nothrow) char[1];
+    sigset_t no_signals;
+    sigemptyset(&no_signals);
+    sigaddset(&no_signals, SIGVTALRM);
+    sigdelset(&no_signals, SIGVTALRM);
+    pthread_sigmask(SIG_BLOCK, &no_signals, nullptr);
+    int saved_errno = errno;
+    epoll_wait(-1, nullptr, 0, 0);
+    epoll_ctl(-1, EPOLL_CTL_DEL, -1, nullptr);
+    timer_getoverrun(workers[0]->timer);
+    pthread_kill(workers[0]->kernel_thread, 0);
+    ssize_t result = write(-1, nullptr, 0) + read(-1, nullptr, 0) + close(-1) + munmap(nullptr, 0) +
+                     madvise(nullptr, 0, MADV_DONTNEED);
+    // a size the compiler cannot see, so the calls are not inlined
+    volatile size_t no_bytes = 0;
+    memcpy(&result, &saved_errno, no_bytes);
+    memset(&result, 0, no_bytes);
+    sched_yield();
+    now_nsecs();
+    errno = saved_errno;
+}
+
+/**
+ * creates the epoll instance the threads waiting for file descriptors are registered in, and the idle workers park
+ * on, with the eventfd that wakes them
+ * @return no return
+*/
+void initialize_poller()
+{
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(epoll_fd < 0 || wakeup_fd < 0)
+    {
+        std::cerr<<"system error: epoll_create error\n";
+        exit(1);
+    }
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.u32 = WAKEUP_EVENT;
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &event) < 0)
+    {
+        std::cerr<<"system error: epoll_ctl error\n";
+        exit(1);
+    }
+}
+
+/**
+ * creates the main thread
+ * @return no return
+*/
+void initialize_main_thread()
+{
+    auto main_thread = new  (std::nothrow) thread;
+    if(main_thread == nullptr)
+    {
+        std::cerr<<"system error: no memory space\n";
+        exit(1);
+    }
+    main_thread->id = 0;
+    main_thread->stack = nullptr;
+    main_thread->home_worker = -1;
+    main_thread->saved_stack = nullptr;
+    main_thread->saved_size = 0;
+    main_thread->saved_capacity = 0;
+    main_thread->thread_quantums=1;
+    main_thread->state = RUNNING;
+    main_thread->blocked = false;
+    main_thread->io_waiting = false;
+    main_thread->io_fd = -1;
+    main_thread->io_events = 0;
+    main_thread->sleep_deadline = 0;
+    main_thread->sync_waiting = false;
+    main_thread->wait_object = nullptr;
+    std::fill(main_thread->state_nsecs, main_thread->state_nsecs + THREAD_STATES, 0);
+    main_thread->state_since = 0;
+    main_thread->voluntary_switches = 0;
+    main_thread->preemptive_switches = 0;
+    main_thread->terminated = false;
+    main_thread->worker = 0;
+    main_thread->priority = DEFAULT_PRIORITY;
+    main_thread->quantum_usecs = 0;
+    main_thread->quantum_level = 0;
+    main_thread->vruntime = 0;
+    main_thread->in_signal_handler = false;
+    workers[0]->running_thread = main_thread->id;
+    workers[0]->running = main_thread;
+    active_threads[0] = main_thread;
+}
+
+/**
+ * maps a worker's idle stack, IDLE_STACK_SIZE above a guard. It lives as long as the process, like the worker.
+ * @return the initial stack pointer of the idle loop, 0 if there is no memory
+*/
+address_t allocate_idle_stack()
+{
+    void * mapping = mmap(nullptr, guard_size() + IDLE_STACK_SIZE, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if(mapping == MAP_FAILED)
+    {
+        return 0;
+    }
+    if(mprotect(mapping, guard_size(), PROT_NONE) < 0)
+    {
+        munmap(mapping, guard_size() + IDLE_STACK_SIZE);
+        return 0;
+    }
+    address_t top = ((address_t) mapping + guard_size() + IDLE_STACK_SIZE) & ~(address_t) 15;
+    return initialize_frame((address_t *) top, &worker_idle_loop);
+}
+
+/**
+ * creates the workers - worker 0 is the calling kernel thread, the rest are started here
+ * @return no return
+*/
+void initialize_workers(int num_workers)
+{
+    for(int i = 0; i < num_workers; i++)
+    {
+        auto w = new (std::nothrow) worker();
+        address_t idle_sp = allocate_idle_stack();
+        if(w == nullptr || idle_sp == 0)
+        {
+            std::cerr<<"system error: no memory space\n";
+            exit(1);
+        }
+        w->id = i;
+        w->running_thread = -1;
+        w->running = nullptr;
+        w->traced_thread = -1;
+        w->stack_owner = -1;
+        w->handoff = -1;
+        w->retired_stack = nullptr;
+        w->idle_sp = idle_sp;
+        workers.push_back(w);
+    }
+    current_worker = workers[0];
+    workers[0]->kernel_thread = pthread_self();
+    initialize_worker_timer(workers[0]);
+    for(int i = 1; i < num_workers; i++)
+    {
+        if(pthread_create(&workers[i]->kernel_thread, nullptr, &worker_main, workers[i]) != 0)
+        {
+            std::cerr<<"system error: pthread_create error\n";
+            exit(1);
+        }
+    }
+}
+
+/**
+ * sync object of the given handle and kind
+ * @return the object, nullptr if there is no such object
+*/
+sync_object * get_sync_object(int handle, sync_kind kind)
+{
+    if(handle < 0 || handle >= MAX_SYNC_OBJECTS)
+    {
+        return nullptr;
+    }
+    sync_object * object = sync_objects[handle];
+    if(object == nullptr || object->kind != kind)
+    {
+        return nullptr;
+    }
+    return object;
+}
+
+/**
+ * creates a sync object, in a critical section
+ * @return the object
+*/
+sync_object * new_sync_object(sync_kind kind, int value)
+{
+    auto object = new (std::nothrow) sync_object;
+    if(object == nullptr)
+    {
+        delete_library();
+        std::cerr<<"system error: no memory space\n";
+        exit(1);
+    }
+    object->kind = kind;
+    object->value = value;
+    object->owner = -1;
+    object->wakeups = 0;
+    object->capacity = 0;
+    object->head = 0;
+    object->lock = nullptr;
+    object->slots = nullptr;
+    object->items = nullptr;
+    return object;
+}
+
+/**
+ * puts a sync object in a free handle, in a critical section
+ * @return the handle, -1 if there is no free handle
+*/
+int add_sync_object(sync_object * object)
+{
+    for(int handle = 0; handle < MAX_SYNC_OBJECTS; handle++)
+    {
+        if(sync_objects[handle] == nullptr)
+        {
+            sync_objects[handle] = object;
+            return handle;
+        }
+    }
+    delete_sync_object(object);
+    std::cerr<<"thread library error: reached max sync objects number\n";
+    return -1;
+}
+
+/**
+ * parks the running thread on the wait queue of the object and makes a scheduling decision, in a critical section
+ * @return no return
+*/
+void park_on(sync_object * object)
+{
+    int tid = this_worker()->running_thread;
+    thread * trd = active_threads[tid];
+    trd->sync_waiting = true;
+    trd->wait_object = object;
+    trd->wait_it = object->waiters.insert(object->waiters.end(), tid);
+    set_state(trd, WAITING);
+    context_switching_helper(true);
+}
+
+/**
+ * takes the first thread off the wait queue of the object and wakes it, in a critical section
+ * @return the tid of the thread, the queue must not be empty
+*/
+int unpark_first(sync_object * object)
+{
+    int tid = object->waiters.front();
+    object->waiters.pop_front();
+    thread * trd = active_threads[tid];
+    trd->sync_waiting = false;
+    trd->wait_object = nullptr;
+    wake_thread(tid);
+    return tid;
+}
+
+/**
+ * takes the mutex, parking the running thread while another thread holds it
+ * @return no return
+*/
+void lock_mutex(sync_object * mutex, int tid)
+{
+    int unlocked = 0;
+    if(mutex->value.compare_exchange_strong(unlocked, 1, std::memory_order_acquire))
+    {
+        mutex->owner = tid;
+        return;
+    }
+    mask_sigvtalrm(SIG_BLOCK);
+    // 2 marks the waiters, so that the holder takes the slow path of unlock_mutex
+    if(mutex->value.exchange(2, std::memory_order_acquire) == 0)
+    {
+        mutex->owner = tid;
+    }
+    else
+    {
+        park_on(mutex);     // returns holding the mutex, handed over by unlock_mutex
+    }
+    mask_sigvtalrm(SIG_UNBLOCK);
+}
+
+/**
+ * releases the mutex, in a critical section. A waiting thread gets the mutex directly, so it cannot be overtaken.
+ * @return no return
+*/
+void release_mutex(sync_object * mutex)
+{
+    if(mutex->waiters.empty())
+    {
+        mutex->owner = -1;
+        mutex->value.store(0, std::memory_order_release);
+        return;
+    }
+    mutex->owner = unpark_first(mutex);
+    mutex->value.store(mutex->waiters.empty() ? 1 : 2, std::memory_order_release);
+}
+
+/**
+ * releases the mutex held by the running thread
+ * @return no return
+*/
+void unlock_mutex(sync_object * mutex)
+{
+    int locked = 1;
+    mutex->owner = -1;
+    if(mutex->value.compare_exchange_strong(locked, 0, std::memory_order_release))
+    {
+        return;
+    }
+    mask_sigvtalrm(SIG_BLOCK);
+    release_mutex(mutex);
+    mask_sigvtalrm(SIG_UNBLOCK);
+}
+
+/**
+ * decrements the semaphore, parking the running thread while it is zero. A negative value counts the waiters.
+ * @return no return
+*/
+void wait_semaphore(sync_object * semaphore)
+{
+    if(semaphore->value.fetch_sub(1, std::memory_order_acquire) > 0)
+    {
+        return;
+    }
+    mask_sigvtalrm(SIG_BLOCK);
+    // a post may have come between the decrement and the critical section
+    if(semaphore->wakeups > 0)
+    {
+        semaphore->wakeups--;
+    }
+    else
+    {
+        park_on(semaphore);
+    }
+    mask_sigvtalrm(SIG_UNBLOCK);
+}
+
+/**
+ * increments the semaphore, waking the first waiting thread if there is one
+ * @return no return
+*/
+void post_semaphore(sync_object * semaphore)
+{
+    if(semaphore->value.fetch_add(1, std::memory_order_release) >= 0)
+    {
+        return;
+    }
+    mask_sigvtalrm(SIG_BLOCK);
+    if(semaphore->waiters.empty())
+    {
+        semaphore->wakeups++;   // the waiter has not parked yet
+    }
+    else
+    {
+        unpark_first(semaphore);
+    }
+    mask_sigvtalrm(SIG_UNBLOCK);
+}
+
+/**
+ * @brief initializes the thread library with num_workers kernel threads running the uthreads (M:N scheduling).
+ *
+ * Each worker has its own READY list and its own preemption timer, measuring the cpu time of that worker only.
+ * A worker whose READY list is empty steals the last READY thread of the longest list, so any thread, including
+ * the main thread, may move between workers. With a single worker this is exactly uthread_init(quantum_usecs).
+ * It is an error to call this function with non-positive quantum_usecs or num_workers.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_init(int quantum_usecs, int num_workers)
+{
+    if(quantum_usecs <= 0)
+    {
+        std::cerr<<"thread library error: negative quantum is not allowed\n";
+        return -1;
+    }
+    if(num_workers <= 0)
+    {
+        std::cerr<<"thread library error: non-positive number of workers\n";
+        return -1;
+    }
+    general_quantum = quantum_usecs;
+    total_quantums = 1;
+    tick_usecs = tick_length();
+    initialize_timer();
+    initialize_poller();
+    initialize_free_ids();
+    active_threads.assign(1, nullptr);
+    initialize_workers(num_workers);
+    initialize_main_thread();
+    set_quantum(workers[0]);
+    bind_library_calls();
+    return 0;
+}
+
+
+/**
+ * @brief initializes the thread library.
+ *
+ * Once this function returns, the main thread (tid == 0) will be set as RUNNING. There is no need to
+ * provide an entry_point or to create a stack for the main thread - it will be using the "regular" stack and PC.
+ * You may assume that this function is called before any other thread library function, and that it is called
+ * exactly once.
+ * The input to the function is the length of a quantum in micro-seconds.
+ * It is an error to call this function with non-positive quantum_usecs.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_init(int quantum_usecs)
+{
+    return uthread_init(quantum_usecs, 1);
+}
+
+
+/**
+ * @brief Switches the library between preemptive scheduling (the default) and cooperative scheduling.
+ *
+ * In cooperative mode a thread runs until it yields, blocks, sleeps or terminates, and the workers' timers tick
+ * only for the watchdog. If watchdog_usecs is positive, a thread that keeps running for a whole watchdog
+ * period without any context switch is reported and preempted. Leaving cooperative mode restarts the quantum of
+ * the RUNNING thread.
+ * It is an error to call this function with a negative watchdog_usecs.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_set_cooperative(int enable, int watchdog_usecs)
+{
+    mask_sigvtalrm(SIG_BLOCK);
+    if(watchdog_usecs < 0)
+    {
+        std::cerr<<"thread library error: negative watchdog quantum is not allowed\n";
+        mask_sigvtalrm(SIG_UNBLOCK);
+        return -1;
+    }
+    cooperative = enable;
+    ::watchdog_usecs = watchdog_usecs;
+    update_tick();
+    for(auto w : workers)
+    {
+        if(w->running_thread != -1)
+        {
+            set_quantum(w);
+        }
+    }
+    mask_sigvtalrm(SIG_UNBLOCK);
+    return 0;
+}
+
+
+/**
+ * @brief Selects the scheduling policy deciding which READY thread runs next.
+ *
+ * 0 - round robin (the default): the READY list is a FIFO queue and priorities are ignored.
+ * 1 - strict priority: the first thread of the most urgent non-empty priority level runs next, and a thread that
+ *     becomes READY preempts a less urgent RUNNING thread at once.
+ * 2 - weighted fair: the thread that ran the least quantums, weighted by its priority, runs next. Each level of
+ *     priority doubles the share of the cpu a thread gets.
+ * The threads that are READY at the time of the call are reordered according to the new policy.
+ * It is an error to call this function with any other policy.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_set_policy(int new_policy)
+{
+    mask_sigvtalrm(SIG_BLOCK);
+    if(new_policy < ROUND_ROBIN || new_policy > WEIGHTED_FAIR)
+    {
+        std::cerr<<"thread library error: unknown scheduling policy\n";
+        mask_sigvtalrm(SIG_UNBLOCK);
+        return -1;
+    }
+    std::vector<std::vector<int>> ready(workers.size());
+    for(auto w : workers)
+    {
+        while(w->ready_lst.size != 0)
+        {
+            ready[w->id].push_back(pop_ready(&w->ready_lst, false));
+        }
+        w->ready_lst.min_vruntime = 0;
+    }
+    if(policy != new_policy)
+    {
+        // the fair policy starts every thread with an equal share
+        for(auto active_thread : active_threads)
+        {
+            if(active_thread != nullptr)
+            {
+                active_thread->vruntime = 0;
+            }
+        }
+    }
+    policy = (scheduling_policy) new_policy;
+    for(auto w : workers)
+    {
+        for(int tid : ready[w->id])
+        {
+            push_ready(&w->ready_lst, tid);
+        }
+    }
+    mask_sigvtalrm(SIG_UNBLOCK);
+    return 0;
+}
+
+
+/**
+ * @brief Sets the priority of the thread with ID tid, between 0 (the most urgent) and 7. Threads start at 4.
+ *
+ * If no thread with ID tid exists, or the priority is out of range, it is considered an error.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_set_priority(int tid, int priority)
+{
+    mask_sigvtalrm(SIG_BLOCK);
+    if(find_thread(tid) == nullptr || active_threads[tid]->terminated)
+    {
+        std::cerr<<"thread library error: there is no thread with the given tid\n";
+        mask_sigvtalrm(SIG_UNBLOCK);
+        return -1;
+    }
+    if(priority < 0 || priority >= PRIORITY_LEVELS)
+    {
+        std::cerr<<"thread library error: priority out of range\n";
+        mask_sigvtalrm(SIG_UNBLOCK);
+        return -1;
+    }
+    thread * trd = active_threads[tid];
+    if(trd->state == READY)
+    {
+        // re-queued so that it is ordered by its new priority
+        int queue_worker = trd->worker;
+        erase_ready(&workers[queue_worker]->ready_lst, tid);
+        trd->priority = priority;
+        push_ready(&workers[queue_worker]->ready_lst, tid);
+    }
+    trd->priority = priority;
+    mask_sigvtalrm(SIG_UNBLOCK);
+    return 0;
+}
+
+
+/**
+ * @brief Sets the length of the quantums of the thread with ID tid in micro-seconds, 0 restores the length given
+ * to uthread_init. It takes effect from the thread's next quantum.
+ *
+ * If no thread with ID tid exists, or quantum_usecs is negative, it is considered an error.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_set_quantum(int tid, int quantum_usecs)
+{
+    mask_sigvtalrm(SIG_BLOCK);
+    if(find_thread(tid) == nullptr || active_threads[tid]->terminated)
+    {
+        std::cerr<<"thread library error: there is no thread with the given tid\n";
+        mask_sigvtalrm(SIG_UNBLOCK);
+        return -1;
+    }
+    if(quantum_usecs < 0)
+    {
+        std::cerr<<"thread library error: negative quantum is not allowed\n";
+        mask_sigvtalrm(SIG_UNBLOCK);
+        return -1;
+    }
+    active_threads[tid]->quantum_usecs = quantum_usecs;
+    if(quantum_usecs != 0 && (min_thread_quantum == 0 || quantum_usecs < min_thread_quantum))
+    {
+        min_thread_quantum = quantum_usecs;
+        update_tick();
+    }
+    mask_sigvtalrm(SIG_UNBLOCK);
+    return 0;
+}
+
+
+/**
+ * @brief Switches the adaptive quantum on or off, off by default.
+ *
+ * With the adaptive quantum, a thread using the general quantum gets a quantum twice as long each time it runs its
+ * quantum out, up to 8 times the general quantum, and back to the general quantum once it gives up the CPU by
+ * itself. While more than 4 threads are READY on a worker, the quantums it starts shrink in proportion, down to a
+ * quarter of the general quantum. Threads given their own quantum by uthread_set_quantum are not affected.
+ *
+ * @return 0.
+*/
+int uthread_set_adaptive_quantum(int enable)
+{
+    mask_sigvtalrm(SIG_BLOCK);
+    adaptive_quantum = enable;
+    update_tick();
+    mask_sigvtalrm(SIG_UNBLOCK);
+    return 0;
+}
+
+
+/**
+ * creates a new READY thread on a stack of its own or on the shared stack of the current worker
+ * @return the ID of the thread, -1 on failure
+*/
+int spawn_thread(thread_entry_point entry_point, bool shared_stack)
+{
+    mask_sigvtalrm(SIG_BLOCK);
+    if (entry_point == nullptr)
+    {
+        std::cerr<<"thread library error: null entry point\n";
+        mask_sigvtalrm(SIG_UNBLOCK);
+        return -1;
+    }
+    int new_id = allocate_id();
+    if(new_id == -1)
+    {
+        std::cerr<<"thread library error: reached max threads number\n";
+        mask_sigvtalrm(SIG_UNBLOCK);
+        return -1;
+    }
+    auto new_thread = setup_thread(entry_point, new_id, shared_stack);
+    active_threads[new_thread->id] = new_thread;
+    make_ready(new_thread->id);
+    int tid = new_thread->id;
+    mask_sigvtalrm(SIG_UNBLOCK);
+    return tid;
+}
+
+/**
+ * @brief Creates a new thread, whose entry point is the function entry_point with the signature
+ * void entry_point(void).
+ *
+ * The thread is added to the end of the READY threads list.
+ * The uthread_spawn function should fail if it would cause the number of concurrent threads to exceed the
+ * limit (MAX_THREAD_NUM).
+ * Each thread should be allocated with a stack of size STACK_SIZE bytes.
+ * It is an error to call this function with a null entry_point.
+ *
+ * @return On success, return the ID of the created thread. On failure, return -1.
+*/
+int uthread_spawn(thread_entry_point entry_point)
+{
+    return spawn_thread(entry_point, false);
+}
+
+
+/**
+ * @brief Creates a new thread like uthread_spawn, that runs on a stack shared by all such threads of the calling
+ * thread's worker instead of a stack of its own.
+ *
+ * The used part of the shared stack is copied out when the thread is switched out for another shared stack
+ * thread, and copied back before it runs again, so a switched out thread takes only as much memory as its stack
+ * actually holds - typically a few hundred bytes for a thread parked in the library. The copy makes its context
+ * switches slower, it runs on its worker only, and pointers to its stack must not be passed to other threads.
+ * It is an error to call this function with a null entry_point.
+ *
+ * @return On success, return the ID of the created thread. On failure, return -1.
+*/
+int uthread_spawn_shared(thread_entry_point entry_point)
+{
+    return spawn_thread(entry_point, true);
+}
+
+/**
+ * @brief Creates n threads, whose entry points are entry_points[0..n-1], and stores their IDs in out_tids.
+ *
+ * Like n calls to uthread_spawn, but the library state is locked once, and the control blocks and stacks missing
+ * from the pools of recycled ones are allocated by one allocation and one mapping for the whole batch.
+ * Either all the threads are created or none is - the call fails if it would exceed MAX_THREAD_NUM.
+ * It is an error to call this function with a non-positive n, null arrays or a null entry point.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_spawn_many(thread_entry_point * entry_points, int n, int * out_tids)
+{
+    mask_sigvtalrm(SIG_BLOCK);
+    if(entry_points == nullptr || out_tids == nullptr || n <= 0)
+    {
+        std::cerr<<"thread library error: invalid spawn batch\n";
+        mask_sigvtalrm(SIG_UNBLOCK);
+        return -1;
+    }
+    if(std::find(entry_points, entry_points + n, nullptr) != entry_points + n)
+    {
+        std::cerr<<"thread library error: null entry point\n";
+        mask_sigvtalrm(SIG_UNBLOCK);
+        return -1;
+    }
+    if(n > free_id_count)
+    {
+        std::cerr<<"thread library error: reached max threads number\n";
+        mask_sigvtalrm(SIG_UNBLOCK);
+        return -1;
+    }
+    if(!reserve_threads(n) || !reserve_stacks(n))
+    {
+        delete_library();
+        std::cerr<<"system error: no memory space\n";
+        exit(1);
+    }
+    for(int i = 0; i < n; i++)
+    {
+        auto new_thread = setup_thread(entry_points[i], allocate_id(), false);
+        active_threads[new_thread->id] = new_thread;
+        make_ready(new_thread->id);
+        out_tids[i] = new_thread->id;
+    }
+    mask_sigvtalrm(SIG_UNBLOCK);
+    return 0;
+}
+
+/**
+ * @brief Terminates the thread with ID tid and deletes it from all relevant control structures.
+ *
+ * All the resources allocated by the library for this thread should be released. If no thread with ID tid exists it
+ * is considered an error. Terminating the main thread (tid == 0) will result in the termination of the entire
+ * process using exit(0) (after releasing the assigned library memory).
+ * A thread RUNNING on another worker is switched out and released by that worker right away.
+ *
+ * @return The function returns 0 if the thread was successfully terminated and -1 otherwise. If a thread terminates
+ * itself or the main thread is terminated, the function does not return.
+*/
+int uthread_terminate(int tid)
+{
+    mask_sigvtalrm(SIG_BLOCK);
+
+    // main thread is terminated:
+    if(tid == 0)
+    {
+        delete_library();
+        exit(0);
+    }
+
+    // thread terminate itself:
+    if(tid == this_worker()->running_thread)
+    {
+        free_thread(tid);
+        this_worker()->running_thread = -1;
+        this_worker()->running = nullptr;
+        context_switching_helper(true);
+    }
+
+    // terminate thread if exists:
+    if(find_thread(tid) == nullptr)
+    {
+        std::cerr<<"thread library error: there is no thread with the given tid\n";
+        mask_sigvtalrm(SIG_UNBLOCK);
+        return -1;
+    }
+    thread * trd = active_threads[tid];
+    if(trd->state == RUNNING)
+    {
+        trd->terminated = true;
+        kick_worker(tid);
+        mask_sigvtalrm(SIG_UNBLOCK);
+        return 0;
+    }
+    if(trd->state == READY)
+    {
+        remove_from_ready(tid);
+    }
+    free_thread(tid);
+    mask_sigvtalrm(SIG_UNBLOCK);
+    return 0;
+}
+
+
+/**
+ * @brief Blocks the thread with ID tid. The thread may be resumed later using uthread_resume.
+ *
+ * If no thread with ID tid exists it is considered as an error. In addition, it is an error to try blocking the
+ * main thread (tid == 0). If a thread blocks itself, a scheduling decision should be made. Blocking a thread in
+ * BLOCKED state has no effect and is not considered an error.
+ * A thread RUNNING on another worker is switched out by that worker right away.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_block(int tid)
+{
+    mask_sigvtalrm(SIG_BLOCK);
+    if(tid == 0)
+    {
+        std::cerr<<"thread library error: cant block the main thread\n"<<std::endl;
+        mask_sigvtalrm(SIG_UNBLOCK);
+        return -1;
+    }
+    if(find_thread(tid) == nullptr || active_threads[tid]->terminated)
+    {
+        std::cerr<<"thread library error: there is no thread with the given tid\n";
+        mask_sigvtalrm(SIG_UNBLOCK);
+        return -1;
+    }
+    thread * trd = active_threads[tid];
+    if(this_worker()->running_thread == tid)
+    {
+        trd->blocked = true;
+        set_state(trd, WAITING);
+        context_switching_helper(true);
+        mask_sigvtalrm(SIG_UNBLOCK);
+        return 0;
+    }
+    if(!trd->blocked)
+    {
+        trd->blocked = true;
+        if(trd->state == READY)
+        {
+            remove_from_ready(tid);
+        }
+        else if(trd->state == RUNNING)
+        {
+            kick_worker(tid);
+        }
+    }
+    mask_sigvtalrm(SIG_UNBLOCK);
+    return 0;
+}
+
+
+/**
+ * @brief Resumes a blocked thread with ID tid and moves it to the READY state.
+ *
+ * Resuming a thread in a RUNNING or READY state has no effect and is not considered as an error. If no thread with
+ * ID tid exists it is considered an error.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_resume(int tid)
+{
+    mask_sigvtalrm(SIG_BLOCK);
+    if(find_thread(tid) == nullptr || active_threads[tid]->terminated)
+    {
+        std::cerr<<"thread library error: there is no thread with the given tid\n";
+        mask_sigvtalrm(SIG_UNBLOCK);
+        return -1;
+    }
+    // a sleeping thread stays asleep, and is READY only when its sleeping time is over
+    active_threads[tid]->blocked = false;
+    wake_thread(tid);
+    mask_sigvtalrm(SIG_UNBLOCK);
+    return 0;
+}
+
+/**
+ * @brief Blocks the RUNNING thread for num_quantums quantums.
+ *
+ * Immediately after the RUNNING thread transitions to the BLOCKED state a scheduling decision should be made.
+ * After the sleeping time is over, the thread should go back to the end of the READY queue.
+ * If the thread which was just RUNNING should also be added to the READY queue, or if multiple threads wake up
+ * at the same time, the order in which they're added to the end of the READY queue doesn't matter.
+ * The number of quantums refers to the number of times a new quantum starts, regardless of the reason. Specifically,
+ * the quantum of the thread which has made the call to uthread_sleep isn’t counted.
+ * It is considered an error if the main thread (tid == 0) calls this function.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_sleep(int num_quantums)
+{
+    mask_sigvtalrm(SIG_BLOCK);
+    if(num_quantums == 0)
+    {
+        mask_sigvtalrm(SIG_UNBLOCK);
+        return 0;
+    }
+    if(num_quantums < 0)
+    {
+        std::cerr<<"thread library error: negative number of quantums\n";
+        mask_sigvtalrm(SIG_UNBLOCK);
+        return -1;
+    }
+    int running_thread = this_worker()->running_thread;
+    if(running_thread == 0)
+    {
+        std::cerr<<"thread library error: main thread can't call uthread_sleep\n";
+        mask_sigvtalrm(SIG_UNBLOCK);
+        return -1;
+    }
+    sleeping_threads[running_thread] = num_quantums;
+    set_state(active_threads[running_thread], WAITING);
+    context_switching_helper(true);
+    mask_sigvtalrm(SIG_UNBLOCK);
+    return 0;
+}
+
+
+/**
+ * @brief Blocks the RUNNING thread for usecs micro-seconds of wall-clock time.
+ *
+ * Unlike uthread_sleep, the sleeping time passes whether or not other threads run, and while every thread waits
+ * the process does not use the cpu. The deadline is checked at every scheduling decision and by the idle workers,
+ * so the thread wakes up within a quantum after it when other threads run. The main thread may sleep as well.
+ * It is an error to call this function with a negative usecs.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_sleep_usecs(int usecs)
+{
+    mask_sigvtalrm(SIG_BLOCK);
+    if(usecs < 0)
+    {
+        std::cerr<<"thread library error: negative sleeping time\n";
+        mask_sigvtalrm(SIG_UNBLOCK);
+        return -1;
+    }
+    if(usecs == 0)
+    {
+        mask_sigvtalrm(SIG_UNBLOCK);
+        return 0;
+    }
+    int running_thread = this_worker()->running_thread;
+    thread * trd = active_threads[running_thread];
+    trd->sleep_deadline = now_nsecs() + usecs * 1000L;
+    sleep_deadlines.insert(std::make_pair(trd->sleep_deadline, running_thread));
+    set_state(trd, WAITING);
+    context_switching_helper(true);
+    mask_sigvtalrm(SIG_UNBLOCK);
+    return 0;
+}
+
+
+/**
+ * @brief Moves the RUNNING thread to the end of the READY queue and makes a scheduling decision.
+ *
+ * This is how threads give up the CPU in cooperative mode, but it may be called in preemptive mode as well.
+ * Like any other scheduling decision it starts a new quantum, even if the calling thread is the only READY one
+ * and keeps running.
+ *
+ * @return On success, return 0.
+*/
+int uthread_yield()
+{
+    mask_sigvtalrm(SIG_BLOCK);
+    preempt_running_thread(true);
+    mask_sigvtalrm(SIG_UNBLOCK);
+    return 0;
+}
+
+
+/**
+ * @brief Parks the RUNNING thread until the file descriptor fd is ready for any of the given epoll events
+ * (EPOLLIN, EPOLLOUT, ...) and makes a scheduling decision.
+ *
+ * The thread is WAITING meanwhile, so a read or write of a non-blocking fd that would block the whole process can
+ * be retried once this function returns. The ready descriptors are collected at every scheduling decision, and
+ * by the idle workers. A thread blocked while waiting stays blocked once its fd is ready, until it is resumed.
+ * It is an error to call this function with a file descriptor that epoll cannot wait on, or that another thread
+ * already waits on.
+ *
+ * @return On success, return the ready events of fd. On failure, return -1.
+*/
+int uthread_wait_fd(int fd, int events)
+{
+    mask_sigvtalrm(SIG_BLOCK);
+    if(io_fd_waiters.count(fd) != 0)
+    {
+        std::cerr<<"thread library error: another thread already waits on the given file descriptor\n";
+        mask_sigvtalrm(SIG_UNBLOCK);
+        return -1;
+    }
+    int running_thread = this_worker()->running_thread;
+    struct epoll_event event = {};
+    event.events = (uint32_t) events | EPOLLONESHOT;
+    event.data.u32 = (uint32_t) running_thread;
+    // a descriptor stays registered after its one shot, it is only re-armed
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) < 0 &&
+       (errno != ENOENT || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0))
+    {
+        std::cerr<<"thread library error: cannot wait on the given file descriptor\n";
+        mask_sigvtalrm(SIG_UNBLOCK);
+        return -1;
+    }
+    thread * trd = active_threads[running_thread];
+    trd->io_waiting = true;
+    trd->io_fd = fd;
+    set_state(trd, WAITING);
+    io_fd_waiters[fd] = running_thread;
+    io_waiters++;
+    context_switching_helper(true);
+    int ready_events = active_threads[this_worker()->running_thread]->io_events;
+    mask_sigvtalrm(SIG_UNBLOCK);
+    return ready_events;
+}
+
+
+/**
+ * @brief Creates a mutex, unlocked.
+ *
+ * Locking and unlocking a mutex no other thread contends for takes a single atomic instruction. A thread that
+ * finds the mutex locked is WAITING until the mutex is handed over to it, in the order of arrival.
+ *
+ * @return On success, return the handle of the mutex. On failure, return -1.
+*/
+int uthread_mutex_create()
+{
+    mask_sigvtalrm(SIG_BLOCK);
+    int handle = add_sync_object(new_sync_object(MUTEX, 0));
+    mask_sigvtalrm(SIG_UNBLOCK);
+    return handle;
+}
+
+
+/**
+ * @brief Locks the mutex, waiting while another thread holds it.
+ *
+ * If no such mutex exists, or the calling thread already holds it, it is considered an error.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_mutex_lock(int mutex)
+{
+    sync_object * object = get_sync_object(mutex, MUTEX);
+    if(object == nullptr)
+    {
+        std::cerr<<"thread library error: there is no mutex with the given handle\n";
+        return -1;
+    }
+    int tid = uthread_get_tid();
+    if(object->owner == tid)
+    {
+        std::cerr<<"thread library error: the mutex is already locked by the thread\n";
+        return -1;
+    }
+    lock_mutex(object, tid);
+    return 0;
+}
+
+
+/**
+ * @brief Unlocks the mutex, the first waiting thread gets it.
+ *
+ * If no such mutex exists, or the calling thread does not hold it, it is considered an error.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_mutex_unlock(int mutex)
+{
+    sync_object * object = get_sync_object(mutex, MUTEX);
+    if(object == nullptr)
+    {
+        std::cerr<<"thread library error: there is no mutex with the given handle\n";
+        return -1;
+    }
+    if(object->owner != uthread_get_tid())
+    {
+        std::cerr<<"thread library error: the mutex is not locked by the thread\n";
+        return -1;
+    }
+    unlock_mutex(object);
+    return 0;
+}
+
+
+/**
+ * @brief Creates a condition variable.
+ *
+ * @return On success, return the handle of the condition variable. On failure, return -1.
+*/
+int uthread_cond_create()
+{
+    mask_sigvtalrm(SIG_BLOCK);
+    int handle = add_sync_object(new_sync_object(CONDITION, 0));
+    mask_sigvtalrm(SIG_UNBLOCK);
+    return handle;
+}
+
+
+/**
+ * @brief Unlocks the mutex and waits on the condition variable, atomically, and locks the mutex again once signaled.
+ *
+ * If no such condition variable or mutex exists, or the calling thread does not hold the mutex, it is considered
+ * an error.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_cond_wait(int cond, int mutex)
+{
+    mask_sigvtalrm(SIG_BLOCK);
+    sync_object * condition = get_sync_object(cond, CONDITION);
+    sync_object * object = get_sync_object(mutex, MUTEX);
+    if(condition == nullptr || object == nullptr)
+    {
+        std::cerr<<"thread library error: there is no condition variable or mutex with the given handle\n";
+        mask_sigvtalrm(SIG_UNBLOCK);
+        return -1;
+    }
+    int tid = this_worker()->running_thread;
+    if(object->owner != tid)
+    {
+        std::cerr<<"thread library error: the mutex is not locked by the thread\n";
+        mask_sigvtalrm(SIG_UNBLOCK);
+        return -1;
+    }
+    condition->value.fetch_add(1, std::memory_order_relaxed);
+    release_mutex(object);
+    park_on(condition);
+    mask_sigvtalrm(SIG_UNBLOCK);
+    lock_mutex(object, tid);
+    return 0;
+}
+
+
+/**
+ * @brief Wakes the first thread waiting on the condition variable, if any. Signaling a condition variable no
+ * thread waits on costs no more than an atomic load.
+ *
+ * If no such condition variable exists it is considered an error.
+ *
+ * @return On success, return 0. On failure, return -1.
 */
-void update_sleeping_thread()
+int uthread_cond_signal(int cond)
 {
-    auto it = sleeping_threads.begin();
-    while (it != sleeping_threads.end())
+    sync_object * condition = get_sync_object(cond, CONDITION);
+    if(condition == nullptr)
     {
-        (*it).second--;
-        if((*it).second <= 0)
-        {
-            auto iter = std::find(blocked_lst.begin(), blocked_lst.end(),(*it).first);
-            if(iter == blocked_lst.end())
-            {
-                ready_lst.push_back((*it).first);
-            }
-            it = sleeping_threads.erase(it);
-        }
-        else{++it;}
+        std::cerr<<"thread library error: there is no condition variable with the given handle\n";
+        return -1;
+    }
+    if(condition->value.load(std::memory_order_relaxed) == 0)
+    {
+        return 0;
+    }
+    mask_sigvtalrm(SIG_BLOCK);
+    if(!condition->waiters.empty())
+    {
+        condition->value.fetch_sub(1, std::memory_order_relaxed);
+        unpark_first(condition);
     }
+    mask_sigvtalrm(SIG_UNBLOCK);
+    return 0;
 }
 
+
 /**
- * switching running threads
- * @return no return
+ * @brief Wakes all the threads waiting on the condition variable.
+ *
+ * If no such condition variable exists it is considered an error.
+ *
+ * @return On success, return 0. On failure, return -1.
 */
-void context_switching_helper()
+int uthread_cond_broadcast(int cond)
 {
-    // running thread already moved to ready/blocked state or been terminated!
-    int ret_val = 0;
-    if(running_thread != -1)
+    sync_object * condition = get_sync_object(cond, CONDITION);
+    if(condition == nullptr)
+    {
+        std::cerr<<"thread library error: there is no condition variable with the given handle\n";
+        return -1;
+    }
+    if(condition->value.load(std::memory_order_relaxed) == 0)
     {
-        ret_val = sigsetjmp(env[running_thread], 1); /* saves running thread env before removal*/
+        return 0;
     }
-    if(ret_val == 0 )
+    mask_sigvtalrm(SIG_BLOCK);
+    while(!condition->waiters.empty())
     {
-        running_thread= ready_lst.front();
-        ready_lst.pop_front();
-        active_threads[running_thread]->thread_quantums++;
-        total_quantums++;
-        update_sleeping_thread();
-        set_quantum();
-        siglongjmp(env[running_thread],1);
+        condition->value.fetch_sub(1, std::memory_order_relaxed);
+        unpark_first(condition);
     }
+    mask_sigvtalrm(SIG_UNBLOCK);
+    return 0;
 }
 
+
 /**
- * pushes the running thread to end of ready list and doing a context switch
- * @return no return
+ * @brief Creates a counting semaphore with the given initial value.
+ *
+ * Waiting on a positive semaphore and posting a semaphore no thread waits on take a single atomic instruction.
+ * It is an error to call this function with a negative value.
+ *
+ * @return On success, return the handle of the semaphore. On failure, return -1.
 */
-void context_switching(int sig)
+int uthread_sem_create(int value)
 {
+    if(value < 0)
+    {
+        std::cerr<<"thread library error: negative semaphore value\n";
+        return -1;
+    }
     mask_sigvtalrm(SIG_BLOCK);
-    ready_lst.push_back(running_thread);
-    context_switching_helper();
+    int handle = add_sync_object(new_sync_object(SEMAPHORE, value));
     mask_sigvtalrm(SIG_UNBLOCK);
+    return handle;
 }
 
+
 /**
- * initialize the signals to sigvtlarm
- * @return no return
+ * @brief Decrements the semaphore, waiting while it is zero.
+ *
+ * If no such semaphore exists it is considered an error.
+ *
+ * @return On success, return 0. On failure, return -1.
 */
-void initialize_mask_set()
+int uthread_sem_wait(int sem)
 {
-    if(sigemptyset(&mask_set)<0)
-    {
-        std::cerr<<"system error: sigemptyset error\n";
-        exit(1);
-    }
-    if(sigaddset(&mask_set, SIGVTALRM)<0)
+    sync_object * semaphore = get_sync_object(sem, SEMAPHORE);
+    if(semaphore == nullptr)
     {
-        std::cerr<<"system error: sigaddset error\n";
-        exit(1);
+        std::cerr<<"thread library error: there is no semaphore with the given handle\n";
+        return -1;
     }
+    wait_semaphore(semaphore);
+    return 0;
 }
 
+
 /**
- * initialize timer
- * @return no return
+ * @brief Increments the semaphore, waking the first waiting thread if there is one.
+ *
+ * If no such semaphore exists it is considered an error.
+ *
+ * @return On success, return 0. On failure, return -1.
 */
-void initialize_timer()
+int uthread_sem_post(int sem)
 {
-    sa.sa_handler = &context_switching;
-    if (sigaction(SIGVTALRM, &sa, nullptr) < 0)
+    sync_object * semaphore = get_sync_object(sem, SEMAPHORE);
+    if(semaphore == nullptr)
     {
-        std::cerr<<"system error: sigaction error\n";
-        exit(1);
+        std::cerr<<"thread library error: there is no semaphore with the given handle\n";
+        return -1;
     }
+    post_semaphore(semaphore);
+    return 0;
 }
 
+
 /**
- * creates the main thread
- * @return no return
+ * @brief Creates a bounded FIFO channel of capacity pointers.
+ *
+ * A channel is a buffer guarded by a mutex and two semaphores counting the free slots and the queued items, so
+ * sending to a channel that is not full and receiving from a channel that is not empty never mask sigvtalrm
+ * unless another thread contends for them.
+ * It is an error to call this function with a non-positive capacity.
+ *
+ * @return On success, return the handle of the channel. On failure, return -1.
 */
-void initialize_main_thread()
+int uthread_chan_create(int capacity)
 {
-    auto main_thread = new  (std::nothrow) thread;
-    if(main_thread == nullptr)
+    if(capacity <= 0)
     {
-        std::cerr<<"system error: no memory space\n";
-        exit(1);
+        std::cerr<<"thread library error: non-positive channel capacity\n";
+        return -1;
     }
-    main_thread->id = 0;
-    main_thread->stack = nullptr;
-    main_thread->thread_quantums=1;
-    running_thread = main_thread->id;
-    active_threads[0] = main_thread;
+    mask_sigvtalrm(SIG_BLOCK);
+    sync_object * channel = new_sync_object(CHANNEL, 0);
+    channel->buffer.resize(capacity);
+    channel->capacity = capacity;
+    channel->lock = new_sync_object(MUTEX, 0);
+    channel->slots = new_sync_object(SEMAPHORE, capacity);
+    channel->items = new_sync_object(SEMAPHORE, 0);
+    int handle = add_sync_object(channel);
+    mask_sigvtalrm(SIG_UNBLOCK);
+    return handle;
 }
 
+
 /**
- * @brief initializes the thread library.
+ * @brief Sends the value to the channel, waiting while the channel is full.
  *
- * Once this function returns, the main thread (tid == 0) will be set as RUNNING. There is no need to
- * provide an entry_point or to create a stack for the main thread - it will be using the "regular" stack and PC.
- * You may assume that this function is called before any other thread library function, and that it is called
- * exactly once.
- * The input to the function is the length of a quantum in micro-seconds.
- * It is an error to call this function with non-positive quantum_usecs.
+ * If no such channel exists it is considered an error.
  *
  * @return On success, return 0. On failure, return -1.
 */
-int uthread_init(int quantum_usecs)
+int uthread_chan_send(int chan, void * value)
 {
-    initialize_mask_set();
-    if(quantum_usecs <= 0)
+    sync_object * channel = get_sync_object(chan, CHANNEL);
+    if(channel == nullptr)
     {
-        std::cerr<<"thread library error: negative quantum is not allowed\n";
+        std::cerr<<"thread library error: there is no channel with the given handle\n";
         return -1;
     }
-    general_quantum = quantum_usecs;
-    total_quantums = 1;
-    initialize_timer();
-    for (int i=1; i<MAX_THREAD_NUM; i++)
+    wait_semaphore(channel->slots);
+    lock_mutex(channel->lock, uthread_get_tid());
+    channel->buffer[(channel->head + channel->value.load(std::memory_order_relaxed)) % channel->capacity] = value;
+    channel->value.fetch_add(1, std::memory_order_relaxed);
+    unlock_mutex(channel->lock);
+    post_semaphore(channel->items);
+    return 0;
+}
+
+
+/**
+ * @brief Receives the oldest value of the channel into *value, waiting while the channel is empty.
+ *
+ * If no such channel exists, or value is null, it is considered an error.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_chan_recv(int chan, void ** value)
+{
+    sync_object * channel = get_sync_object(chan, CHANNEL);
+    if(channel == nullptr || value == nullptr)
     {
-        available_id.push_back(i);
+        std::cerr<<"thread library error: there is no channel with the given handle\n";
+        return -1;
     }
-    initialize_main_thread();
-    set_quantum();
+    wait_semaphore(channel->items);
+    lock_mutex(channel->lock, uthread_get_tid());
+    *value = channel->buffer[channel->head];
+    channel->head = (channel->head + 1) % channel->capacity;
+    channel->value.fetch_sub(1, std::memory_order_relaxed);
+    unlock_mutex(channel->lock);
+    post_semaphore(channel->slots);
     return 0;
 }
 
 
 /**
- * @brief Creates a new thread, whose entry point is the function entry_point with the signature
- * void entry_point(void).
+ * @brief Destroys the mutex, condition variable, semaphore or channel with the given handle.
  *
- * The thread is added to the end of the READY threads list.
- * The uthread_spawn function should fail if it would cause the number of concurrent threads to exceed the
- * limit (MAX_THREAD_NUM).
- * Each thread should be allocated with a stack of size STACK_SIZE bytes.
- * It is an error to call this function with a null entry_point.
+ * If no such object exists, or threads wait on it, it is considered an error.
  *
- * @return On success, return the ID of the created thread. On failure, return -1.
+ * @return On success, return 0. On failure, return -1.
 */
-int uthread_spawn(thread_entry_point entry_point)
+int uthread_sync_destroy(int handle)
 {
     mask_sigvtalrm(SIG_BLOCK);
-    if (entry_point == nullptr)
+    if(handle < 0 || handle >= MAX_SYNC_OBJECTS || sync_objects[handle] == nullptr)
     {
-        std::cerr<<"thread library error: null entry point\n";
+        std::cerr<<"thread library error: there is no sync object with the given handle\n";
+        mask_sigvtalrm(SIG_UNBLOCK);
         return -1;
     }
-    if(available_id.empty())
+    sync_object * object = sync_objects[handle];
+    if(!object->waiters.empty() || (object->kind == CHANNEL &&
+       (!object->slots->waiters.empty() || !object->items->waiters.empty() || !object->lock->waiters.empty())))
     {
-        std::cerr<<"thread library error: reached max threads number\n";
+        std::cerr<<"thread library error: threads are waiting on the sync object\n";
+        mask_sigvtalrm(SIG_UNBLOCK);
         return -1;
     }
-    auto min_val=  std::min_element(available_id.begin(), available_id.end());
-    auto new_thread = setup_thread(entry_point, *min_val);
-    available_id.erase(min_val);
-    ready_lst.push_back(new_thread->id);
-    active_threads[new_thread->id] = new_thread;
+    sync_objects[handle] = nullptr;
+    delete_sync_object(object);
     mask_sigvtalrm(SIG_UNBLOCK);
-    return new_thread->id;
+    return 0;
 }
 
+
 /**
- * @brief Terminates the thread with ID tid and deletes it from all relevant control structures.
+ * @brief Turns the scheduler instrumentation on or off, and sets the capacity of the trace ring buffer.
  *
- * All the resources allocated by the library for this thread should be released. If no thread with ID tid exists it
- * is considered an error. Terminating the main thread (tid == 0) will result in the termination of the entire
- * process using exit(0) (after releasing the assigned library memory).
+ * While enable_stats is set, the library accounts the time each thread spends in each state, the number of its
+ * voluntary and preemptive context switches, the latency of the context switches and the time spent in its
+ * critical sections. If trace_events is positive, the beginning and the end of every run of a thread are recorded
+ * in a ring buffer of that many events, keeping the latest ones, for uthread_export_trace. Setting the capacity
+ * discards the recorded events. When both are off the instrumentation costs a branch per context switch.
+ * It is an error to call this function with a negative trace_events.
  *
- * @return The function returns 0 if the thread was successfully terminated and -1 otherwise. If a thread terminates
- * itself or the main thread is terminated, the function does not return.
+ * @return On success, return 0. On failure, return -1.
 */
-int uthread_terminate(int tid)
+int uthread_set_instrumentation(int enable_stats, int trace_events)
 {
     mask_sigvtalrm(SIG_BLOCK);
-
-    // main thread is terminated:
-    if(tid == 0)
+    if(trace_events < 0)
     {
-        delete_library();
-        exit(0);
-    }
-
-    // thread terminate itself:
-    if(tid == running_thread)
-    {
-        available_id.push_back(tid);
-        delete_thread(&active_threads[running_thread]);
-        active_threads[tid] = nullptr;
-        running_thread = -1;
-        context_switching_helper();
+        std::cerr<<"thread library error: negative number of trace events\n";
         mask_sigvtalrm(SIG_UNBLOCK);
+        return -1;
     }
-
-    // terminate thread if exists:
-    auto it=ready_lst.begin();
-    for (; it != ready_lst.end(); ++it)
-    {
-        if((*it) == tid)
-        {
-            ready_lst.erase(it);
-            available_id.push_back(tid);
-            delete_thread(&(active_threads[tid]));
-            active_threads[tid] = nullptr;
-            mask_sigvtalrm(SIG_UNBLOCK);
-            return 0;
-        }
-    }
-    it=blocked_lst.begin();
-    for (; it != blocked_lst.end(); ++it)
+    if(enable_stats && !stats_enabled)
     {
-        if((*it) == tid)
+        // the time before the instrumentation was turned on is not accounted
+        long now = now_nsecs();
+        for(auto active_thread : active_threads)
         {
-            blocked_lst.erase(it);
-            available_id.push_back(tid);
-            delete_thread(&(active_threads[tid]));
-            active_threads[tid] = nullptr;
-            if(sleeping_threads.find(tid)!=sleeping_threads.end())
+            if(active_thread != nullptr)
             {
-                sleeping_threads.erase(tid);
+                active_thread->state_since = now;
             }
-            mask_sigvtalrm(SIG_UNBLOCK);
-            return 0;
         }
+        critical_since = now;
     }
-    auto iter = sleeping_threads.begin();
-    for(;iter != sleeping_threads.end();it++)
+    stats_enabled = enable_stats;
+    trace_buffer.assign(trace_events, trace_event());
+    trace_next = 0;
+    trace_wrapped = false;
+    for(auto w : workers)
     {
-        if(iter->first == tid)
-        {
-            sleeping_threads.erase(tid);
-            available_id.push_back(tid);
-            delete_thread(&active_threads[tid]);
-            active_threads[tid] = nullptr;
-            mask_sigvtalrm(SIG_UNBLOCK);
-            return 0;
-        }
+        w->traced_thread = -1;
+        w->switch_start = 0;
     }
-    std::cerr<<"thread library error: there is no thread with the given tid\n";
-    return -1;
+    mask_sigvtalrm(SIG_UNBLOCK);
+    return 0;
 }
 
 
 /**
- * @brief Blocks the thread with ID tid. The thread may be resumed later using uthread_resume.
+ * @brief Returns the time the thread with ID tid spent in the given state - 0 READY, 1 RUNNING, 2 WAITING - while
+ * the instrumentation was on.
  *
- * If no thread with ID tid exists it is considered as an error. In addition, it is an error to try blocking the
- * main thread (tid == 0). If a thread blocks itself, a scheduling decision should be made. Blocking a thread in
- * BLOCKED state has no effect and is not considered an error.
+ * If no thread with ID tid exists, or the state is out of range, it is considered an error.
  *
- * @return On success, return 0. On failure, return -1.
+ * @return On success, return the time in nanoseconds. On failure, return -1.
 */
-int uthread_block(int tid)
+long uthread_get_state_time(int tid, int state)
 {
     mask_sigvtalrm(SIG_BLOCK);
-    if(tid == 0)
+    if(find_thread(tid) == nullptr)
     {
-        std::cerr<<"thread library error: cant block the main thread\n"<<std::endl;
+        std::cerr<<"thread library error: there is no thread with the given tid\n";
+        mask_sigvtalrm(SIG_UNBLOCK);
         return -1;
     }
-    auto iter = ready_lst.begin();
-    for(;iter != ready_lst.end(); iter++)
+    if(state < READY || state > WAITING)
     {
-        if((*iter) == tid) {
-            blocked_lst.push_back((tid));
-            ready_lst.erase(iter);
-            mask_sigvtalrm(SIG_UNBLOCK);
-            return 0;
-        }
-    }
-    if(running_thread == tid)
-    {
-        blocked_lst.push_back(running_thread);
-        context_switching_helper();
+        std::cerr<<"thread library error: there is no such state\n";
         mask_sigvtalrm(SIG_UNBLOCK);
-        return 0;
-    }
-    iter = blocked_lst.begin();
-    for(;iter != blocked_lst.end(); iter++)
-    {
-        if ((*iter)== tid)
-        {
-            mask_sigvtalrm(SIG_UNBLOCK);
-            return 0;
-        }
+        return -1;
     }
-    auto it = sleeping_threads.find(tid);
-    if (it != sleeping_threads.end())
+    thread * trd = active_threads[tid];
+    long nsecs = trd->state_nsecs[state];
+    if(stats_enabled && trd->state == state)
     {
-        blocked_lst.push_back(it->first);
-        mask_sigvtalrm(SIG_UNBLOCK);
-        return 0;
+        nsecs += now_nsecs() - trd->state_since;
     }
-    std::cerr<<"thread library error: there is no thread with the given tid\n";
-    return -1;
+    mask_sigvtalrm(SIG_UNBLOCK);
+    return nsecs;
 }
 
 
 /**
- * @brief Resumes a blocked thread with ID tid and moves it to the READY state.
+ * @brief Returns the number of context switches of the thread with ID tid while the instrumentation was on - the
+ * voluntary ones (yield, block, sleep, waits) if voluntary is set, the preemptive ones (quantum expiry, preemption
+ * by a more urgent thread, block or terminate by another worker) otherwise.
  *
- * Resuming a thread in a RUNNING or READY state has no effect and is not considered as an error. If no thread with
- * ID tid exists it is considered an error.
+ * If no thread with ID tid exists it is considered an error.
  *
- * @return On success, return 0. On failure, return -1.
+ * @return On success, return the number of context switches. On failure, return -1.
 */
-int uthread_resume(int tid)
+int uthread_get_switches(int tid, int voluntary)
 {
     mask_sigvtalrm(SIG_BLOCK);
-    if (running_thread == tid)
+    if(find_thread(tid) == nullptr)
     {
+        std::cerr<<"thread library error: there is no thread with the given tid\n";
         mask_sigvtalrm(SIG_UNBLOCK);
-        return 0;
+        return -1;
     }
-    if(sleeping_threads.find(tid)!=sleeping_threads.end())
+    thread * trd = active_threads[tid];
+    int switches = voluntary ? trd->voluntary_switches : trd->preemptive_switches;
+    mask_sigvtalrm(SIG_UNBLOCK);
+    return switches;
+}
+
+
+/**
+ * @brief Returns bucket of the context switch latency histogram - the number of context switches, from the
+ * scheduling decision until the next thread runs, that took between 2^bucket and 2^(bucket+1) nanoseconds.
+ * The last bucket also counts all the longer ones.
+ *
+ * It is an error to call this function with a bucket out of [0, 32).
+ *
+ * @return On success, return the number of context switches. On failure, return -1.
+*/
+long uthread_get_switch_latency(int bucket)
+{
+    mask_sigvtalrm(SIG_BLOCK);
+    if(bucket < 0 || bucket >= LATENCY_BUCKETS)
     {
-        auto it = blocked_lst.begin();
-        for(;it != blocked_lst.end(); it++)
-        {
-            if((*it) == tid)
-            {
-                blocked_lst.erase(it);
-                break;
-            }
-        }
+        std::cerr<<"thread library error: there is no such histogram bucket\n";
         mask_sigvtalrm(SIG_UNBLOCK);
-        return 0;
-    }
-    auto iter = blocked_lst.begin();
-    for(;iter != blocked_lst.end(); iter++)
-    {
-        if((*iter) == tid) {
-            ready_lst.push_back((tid));
-            blocked_lst.erase(iter);
-            mask_sigvtalrm(SIG_UNBLOCK);
-            return 0;
-        }
-    }
-    iter = ready_lst.begin();
-    for(;iter != ready_lst.end(); iter++)
-    {
-        if((*iter) == tid)
-        {
-            mask_sigvtalrm(SIG_UNBLOCK);
-            return 0;
-        }
+        return -1;
     }
-    std::cerr<<"thread library error: there is no thread with the given tid\n";
-    return -1;
+    long switches = switch_latency[bucket];
+    mask_sigvtalrm(SIG_UNBLOCK);
+    return switches;
 }
 
+
 /**
- * @brief Blocks the RUNNING thread for num_quantums quantums.
+ * @brief Returns the time spent in the critical sections of the library - with sigvtalrm masked and the scheduler
+ * lock held - while the instrumentation was on, summed over all workers.
  *
- * Immediately after the RUNNING thread transitions to the BLOCKED state a scheduling decision should be made.
- * After the sleeping time is over, the thread should go back to the end of the READY queue.
- * If the thread which was just RUNNING should also be added to the READY queue, or if multiple threads wake up
- * at the same time, the order in which they're added to the end of the READY queue doesn't matter.
- * The number of quantums refers to the number of times a new quantum starts, regardless of the reason. Specifically,
- * the quantum of the thread which has made the call to uthread_sleep isn’t counted.
- * It is considered an error if the main thread (tid == 0) calls this function.
+ * @return The time in nanoseconds.
+*/
+long uthread_get_critical_time()
+{
+    mask_sigvtalrm(SIG_BLOCK);
+    long nsecs = critical_nsecs;
+    mask_sigvtalrm(SIG_UNBLOCK);
+    return nsecs;
+}
+
+
+/**
+ * @brief Writes the recorded trace to the file at path in the Chrome trace event format, to be opened in
+ * chrome://tracing or Perfetto. Every worker is a track, and every run of a thread is a slice on it.
+ *
+ * If the file cannot be written it is considered an error.
  *
  * @return On success, return 0. On failure, return -1.
 */
-int uthread_sleep(int num_quantums)
+int uthread_export_trace(const char * path)
 {
     mask_sigvtalrm(SIG_BLOCK);
-    if(num_quantums == 0)
+    // copied, so the file is written outside of the critical section
+    std::vector<trace_event> events;
+    if(trace_wrapped)
     {
-        mask_sigvtalrm(SIG_UNBLOCK);
-        return 0;
+        events.assign(trace_buffer.begin() + (long) trace_next, trace_buffer.end());
     }
-    if(num_quantums < 0)
+    events.insert(events.end(), trace_buffer.begin(), trace_buffer.begin() + (long) trace_next);
+    size_t num_workers = workers.size();
+    mask_sigvtalrm(SIG_UNBLOCK);
+
+    std::ofstream file(path);
+    if(!file)
     {
-        std::cerr<<"thread library error: negative number of quantums\n";
+        std::cerr<<"thread library error: cannot open the trace file\n";
         return -1;
     }
-    if(running_thread == 0)
+    file<<"{\"traceEvents\":[";
+    // every element after the first follows a comma
+    const char * separator = "\n";
+    for(size_t i = 0; i < num_workers; i++)
     {
-        std::cerr<<"thread library error: main thread can't call uthread_sleep\n";
+        file<<separator<<"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":"<<i
+            <<",\"args\":{\"name\":\"worker "<<i<<"\"}}";
+        separator = ",\n";
+    }
+    for(const auto & event : events)
+    {
+        file<<separator<<"{\"name\":\"uthread "<<event.tid<<"\",\"ph\":\""<<event.phase<<"\",\"pid\":0,\"tid\":"<<event.worker
+            <<",\"ts\":"<<event.timestamp / 1000<<"."<<std::setw(3)<<std::setfill('0')<<event.timestamp % 1000;
+        if(event.phase == 'E')
+        {
+            file<<",\"args\":{\"switch\":\""<<(event.voluntary ? "voluntary" : "preemptive")<<"\"}";
+        }
+        file<<"}";
+        separator = ",\n";
+    }
+    file<<"\n]}\n";
+    if(!file)
+    {
+        std::cerr<<"thread library error: cannot write the trace file\n";
         return -1;
     }
-    sleeping_threads[running_thread] = num_quantums;
-    context_switching_helper();
-    mask_sigvtalrm(SIG_UNBLOCK);
     return 0;
 }
 
@@ -561,7 +3324,7 @@ int uthread_sleep(int num_quantums)
 */
 int uthread_get_tid()
 {
-    return running_thread;
+    return this_worker()->running_thread;
 }
 
 
@@ -591,14 +3354,16 @@ int uthread_get_total_quantums()
 int uthread_get_quantums(int tid)
 {
     mask_sigvtalrm(SIG_BLOCK);
-    if (active_threads[tid] != nullptr)
+    if (find_thread(tid) != nullptr)
     {
+        int quantums = active_threads[tid]->thread_quantums;
         mask_sigvtalrm(SIG_UNBLOCK);
-        return active_threads[tid]->thread_quantums;
+        return quantums;
     }
     else
     {
         std::cerr<<"thread library error: there is no thread with the given tid\n";
+        mask_sigvtalrm(SIG_UNBLOCK);
         return -1;
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,266 @@
+#include "uthreads.h"
+#include <iostream>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+/*
+ * Microbenchmarks of the uthreads library, each printing its result as one JSON object per line:
+ *
+ *   uthreads_benchmark yield [iterations]      yield to yield latency of two threads on one worker
+ *   uthreads_benchmark switch [rounds]         switch latency along a ring of threads that sleep a quantum each
+ *   uthreads_benchmark spawn [threads] [shared]   spawn rate and memory per idle thread, with stacks of their own
+ *                                                 or on the shared stack
+ *
+ * Built with the library, e.g. g++ -O2 "Proj2 uthreads_benchmark.cpp" "Proj2 uthreads.cpp" -o uthreads_benchmark
+ * The switch benchmark uses the stock interface only, so the same driver built with the sigsetjmp based library
+ * measures the baseline the other numbers compare to.
+ * The spawn benchmark spawns at most MAX_THREAD_NUM - 1 threads. The stock uthreads.h defines it as 100, which
+ * is too few to measure memory per thread - edit the define in uthreads.h for a larger run, the library sizes its
+ * tables from it.
+*/
+
+// the extensions of the library, beyond the stock uthreads.h - weak, so the driver links without them
+int uthread_yield() __attribute__((weak));
+int uthread_spawn_shared(thread_entry_point entry_point) __attribute__((weak));
+
+#define DEFAULT_ITERATIONS 1000000
+#define DEFAULT_ROUNDS 2000
+#define RING_THREADS 64
+#define RING_QUANTUM_USECS 1000
+#define DEFAULT_THREADS 10000
+#define LONG_QUANTUM_USECS 1000000      // no preemption in the middle of a measured loop
+
+static volatile bool stop_partner = false;
+static volatile long started_threads = 0;
+static long ring_rounds = 0;
+static std::vector<long> round_first;
+static std::vector<long> round_last;
+static volatile int finished_threads = 0;
+
+/**
+ * monotonic time of the measurements
+ * @return the time in nanoseconds
+*/
+static long clock_nsecs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+/**
+ * the other side of the yield benchmark - yields back until the main thread is done
+ * @return no return
+*/
+static void yield_partner()
+{
+    while(!stop_partner)
+    {
+        uthread_yield();
+    }
+    uthread_terminate(uthread_get_tid());
+}
+
+/**
+ * the main thread and a partner yield to each other, so every yield is one context switch
+ * @return 0 on success, -1 otherwise
+*/
+static int yield_benchmark(long iterations)
+{
+    if(uthread_yield == nullptr)
+    {
+        std::cerr<<"the yield benchmark needs uthread_yield\n";
+        return -1;
+    }
+    if(uthread_init(LONG_QUANTUM_USECS) < 0 || uthread_spawn(&yield_partner) < 0)
+    {
+        return -1;
+    }
+    // warm up - the partner's first run starts its stack
+    for(int i = 0; i < 1000; i++)
+    {
+        uthread_yield();
+    }
+    long start = clock_nsecs();
+    for(long i = 0; i < iterations; i++)
+    {
+        uthread_yield();
+    }
+    long elapsed = clock_nsecs() - start;
+    stop_partner = true;
+    uthread_yield();
+    // each iteration is a round trip - the main thread's yield and the partner's
+    printf("{\"benchmark\": \"yield\", \"iterations\": %ld, \"ns_per_yield\": %.1f}\n", iterations,
+           (double) elapsed / (double) (2 * iterations));
+    return 0;
+}
+
+/**
+ * a thread of the ring - sleeping a quantum puts it behind the rest of the ring, so the ring runs in turn. Marks
+ * when the first thread of every round resumed and when the last went to sleep.
+ * @return no return
+*/
+static void ring_thread()
+{
+    for(long round = 0; round < ring_rounds; round++)
+    {
+        long now = clock_nsecs();
+        if(round_first[round] == 0)
+        {
+            round_first[round] = now;
+        }
+        round_last[round] = clock_nsecs();
+        uthread_sleep(1);
+    }
+    finished_threads++;
+    uthread_block(uthread_get_tid());
+}
+
+/**
+ * the threads of the ring sleep in turn, while the main thread spins out its quantums. Every round, from the first
+ * ring thread resuming to the last going to sleep, is a switch less than there are threads - each through
+ * uthread_sleep, the scheduling and the context switch. Reports the median round.
+ * @return 0 on success, -1 otherwise
+*/
+static int switch_benchmark(long rounds)
+{
+    int threads = std::min(RING_THREADS, MAX_THREAD_NUM - 1);
+    ring_rounds = rounds;
+    round_first.assign(rounds, 0);
+    round_last.assign(rounds, 0);
+    if(threads < 2 || uthread_init(RING_QUANTUM_USECS) < 0)
+    {
+        return -1;
+    }
+    for(int i = 0; i < threads; i++)
+    {
+        if(uthread_spawn(&ring_thread) < 0)
+        {
+            return -1;
+        }
+    }
+    while(finished_threads < threads)
+    {
+    }
+    std::vector<double> ns_per_switch(rounds);
+    for(long round = 0; round < rounds; round++)
+    {
+        ns_per_switch[round] = (double) (round_last[round] - round_first[round]) / (double) (threads - 1);
+    }
+    std::sort(ns_per_switch.begin(), ns_per_switch.end());
+    printf("{\"benchmark\": \"switch\", \"threads\": %d, \"rounds\": %ld, \"ns_per_switch\": %.1f}\n", threads,
+           rounds, ns_per_switch[rounds / 2]);
+    return 0;
+}
+
+/**
+ * resident memory of the process, from /proc/self/statm
+ * @return the resident size in bytes, 0 if it cannot be read
+*/
+static long resident_bytes()
+{
+    long size = 0;
+    long resident = 0;
+    std::ifstream statm("/proc/self/statm");
+    if(!(statm>>size>>resident))
+    {
+        return 0;
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * a mostly idle thread - runs once, and stays blocked from then on
+ * @return no return
+*/
+static void idle_thread()
+{
+    started_threads++;
+    uthread_block(uthread_get_tid());
+}
+
+/**
+ * spawns idle threads, lets each of them run once so its stack is in use, and reports the spawn rate and the memory
+ * the threads take. Spawning stops early if the library runs out of stacks or tids.
+ * @return 0 on success, -1 otherwise
+*/
+static int spawn_benchmark(long threads, bool shared)
+{
+    if(uthread_yield == nullptr || (shared && uthread_spawn_shared == nullptr))
+    {
+        std::cerr<<"the spawn benchmark needs uthread_yield and uthread_spawn_shared\n";
+        return -1;
+    }
+    if(uthread_init(LONG_QUANTUM_USECS) < 0)
+    {
+        return -1;
+    }
+    long resident_before = resident_bytes();
+    long spawned = 0;
+    long start = clock_nsecs();
+    while(spawned < threads && (shared ? uthread_spawn_shared(&idle_thread) : uthread_spawn(&idle_thread)) >= 0)
+    {
+        spawned++;
+    }
+    long elapsed = clock_nsecs() - start;
+    long resident_spawned = resident_bytes();
+    // every spawned thread runs before the main thread's turn comes again
+    while(started_threads < spawned)
+    {
+        uthread_yield();
+    }
+    long resident_started = resident_bytes();
+    if(spawned == 0)
+    {
+        return -1;
+    }
+    printf("{\"benchmark\": \"spawn\", \"stacks\": \"%s\", \"threads\": %ld, \"spawns_per_sec\": %.0f, "
+           "\"bytes_per_spawned_thread\": %.0f, \"bytes_per_started_thread\": %.0f}\n", shared ? "shared" : "own",
+           spawned, (double) spawned * 1e9 / (double) std::max(elapsed, 1L),
+           (double) (resident_spawned - resident_before) / (double) spawned,
+           (double) (resident_started - resident_before) / (double) spawned);
+    return 0;
+}
+
+int main(int argc, char ** argv)
+{
+    if(argc < 2)
+    {
+        std::cerr<<"usage: "<<argv[0]<<" yield [iterations] | switch [rounds] | spawn [threads] [shared]\n";
+        return 1;
+    }
+    int result = -1;
+    if(strcmp(argv[1], "yield") == 0)
+    {
+        long iterations = argc > 2 ? atol(argv[2]) : DEFAULT_ITERATIONS;
+        result = iterations > 0 ? yield_benchmark(iterations) : -1;
+    }
+    else if(strcmp(argv[1], "switch") == 0)
+    {
+        long rounds = argc > 2 ? atol(argv[2]) : DEFAULT_ROUNDS;
+        result = rounds > 0 ? switch_benchmark(rounds) : -1;
+    }
+    else if(strcmp(argv[1], "spawn") == 0)
+    {
+        long threads = argc > 2 ? atol(argv[2]) : std::min(DEFAULT_THREADS, MAX_THREAD_NUM - 1);
+        bool shared = argc > 3 && strcmp(argv[3], "shared") == 0;
+        result = threads > 0 ? spawn_benchmark(threads, shared) : -1;
+    }
+    else
+    {
+        std::cerr<<"unknown benchmark "<<argv[1]<<"\n";
+    }
+    if(result != 0)
+    {
+        return 1;
+    }
+    fflush(stdout);
+    uthread_terminate(0);
+    return 0;
+}
@@ -0,0 +1,303 @@
+#include "uthreads.h"
+#include <iostream>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+/*
+ * Tests of the uthreads library, each printing PASS or what failed:
+ *
+ *   uthreads_test wait_fd [workers]      threads waiting for pipes, woken as the main thread writes to them
+ *   uthreads_test stress [runs]          mixed workloads on four workers - counters behind a mutex, threads on
+ *                                        the shared stack, a channel, file descriptor waits and sleeps
+ *
+ * Built with the library at the stock STACK_SIZE, e.g. g++ -O2 "Proj2 uthreads_test.cpp" "Proj2 uthreads.cpp" -o
+ * uthreads_test - the library runs its scheduling on the threads' stacks, so the tests check it fits there. The
+ * thread functions print nothing, printf needs more stack than they have.
+*/
+
+// the extensions of the library, beyond the interface of uthreads.h
+int uthread_init(int quantum_usecs, int num_workers);
+int uthread_yield();
+int uthread_wait_fd(int fd, int events);
+int uthread_sleep_usecs(int usecs);
+int uthread_spawn_shared(thread_entry_point entry_point);
+int uthread_spawn_many(thread_entry_point * entry_points, int n, int * out_tids);
+int uthread_mutex_create();
+int uthread_mutex_lock(int mutex);
+int uthread_mutex_unlock(int mutex);
+int uthread_chan_create(int capacity);
+int uthread_chan_send(int chan, void * value);
+int uthread_chan_recv(int chan, void ** value);
+
+#define QUANTUM_USECS 1000
+#define WAIT_FD_THREADS 8
+#define WAIT_FD_ROUNDS 200
+#define STRESS_RUNS 40
+#define STRESS_WORKERS 4
+#define STRESS_COUNTERS 24                  // threads of spawn_many incrementing the counter, as many on the shared stack
+#define STRESS_INCREMENTS 200
+#define STRESS_ITEMS 2000                   // sent through the channel
+#define CHANNEL_CAPACITY 8
+
+static int pipes[WAIT_FD_THREADS][2];
+static volatile int woken[WAIT_FD_THREADS];
+static volatile int failures = 0;
+
+/**
+ * waits for its pipe WAIT_FD_ROUNDS times, reading the byte that woke it each time
+ * @return no return
+*/
+static void pipe_reader()
+{
+    int index = uthread_get_tid() % WAIT_FD_THREADS;
+    for(int round = 0; round < WAIT_FD_ROUNDS; round++)
+    {
+        char byte;
+        if(!(uthread_wait_fd(pipes[index][0], EPOLLIN) & EPOLLIN) || read(pipes[index][0], &byte, 1) != 1)
+        {
+            failures++;
+        }
+        woken[index]++;
+    }
+    uthread_terminate(uthread_get_tid());
+}
+
+static int counter_mutex;
+static volatile long counter = 0;
+static int channel;
+static volatile long received_sum = 0;
+static int stress_pipe[2];
+static volatile int stress_pipe_read = 0;
+static volatile int stress_done = 0;
+
+/**
+ * increments the counter under the mutex, yielding in the middle, so a lost increment shows a mutex that let two
+ * threads in or a thread that ran twice at once
+ * @return no return
+*/
+static void counting_thread()
+{
+    for(int i = 0; i < STRESS_INCREMENTS; i++)
+    {
+        uthread_mutex_lock(counter_mutex);
+        long value = counter;
+        if(i % 4 == 0)
+        {
+            uthread_yield();
+        }
+        counter = value + 1;
+        uthread_mutex_unlock(counter_mutex);
+        if(i % 50 == 0)
+        {
+            uthread_sleep_usecs(50);
+        }
+    }
+    __sync_fetch_and_add(&stress_done, 1);
+    uthread_terminate(uthread_get_tid());
+}
+
+/**
+ * sends the numbers 1 to STRESS_ITEMS through the channel
+ * @return no return
+*/
+static void producer_thread()
+{
+    for(long item = 1; item <= STRESS_ITEMS; item++)
+    {
+        uthread_chan_send(channel, (void *) item);
+    }
+    __sync_fetch_and_add(&stress_done, 1);
+    uthread_terminate(uthread_get_tid());
+}
+
+/**
+ * sums what the channel carries
+ * @return no return
+*/
+static void consumer_thread()
+{
+    long sum = 0;
+    for(int i = 0; i < STRESS_ITEMS; i++)
+    {
+        void * item = nullptr;
+        uthread_chan_recv(channel, &item);
+        sum += (long) item;
+    }
+    received_sum = sum;
+    __sync_fetch_and_add(&stress_done, 1);
+    uthread_terminate(uthread_get_tid());
+}
+
+/**
+ * waits for the stress pipe and reads its byte
+ * @return no return
+*/
+static void pipe_waiting_thread()
+{
+    char byte;
+    if((uthread_wait_fd(stress_pipe[0], EPOLLIN) & EPOLLIN) && read(stress_pipe[0], &byte, 1) == 1)
+    {
+        stress_pipe_read = 1;
+    }
+    __sync_fetch_and_add(&stress_done, 1);
+    uthread_terminate(uthread_get_tid());
+}
+
+/**
+ * one stress run, on the library initialized by the first. Every thread of a run is gone before the next starts.
+ * @return 0 on success, -1 otherwise
+*/
+static int stress_run(int run)
+{
+    counter = 0;
+    received_sum = 0;
+    stress_pipe_read = 0;
+    stress_done = 0;
+    thread_entry_point entry_points[STRESS_COUNTERS];
+    int tids[STRESS_COUNTERS];
+    std::fill(entry_points, entry_points + STRESS_COUNTERS, &counting_thread);
+    if(uthread_spawn_many(entry_points, STRESS_COUNTERS, tids) < 0)
+    {
+        return -1;
+    }
+    for(int i = 0; i < STRESS_COUNTERS; i++)
+    {
+        if(uthread_spawn_shared(&counting_thread) < 0)
+        {
+            return -1;
+        }
+    }
+    if(uthread_spawn_shared(&producer_thread) < 0 || uthread_spawn(&consumer_thread) < 0 ||
+       uthread_spawn_shared(&pipe_waiting_thread) < 0)
+    {
+        return -1;
+    }
+    int threads = 2 * STRESS_COUNTERS + 3;
+    uthread_sleep_usecs(1000);
+    if(write(stress_pipe[1], "x", 1) != 1)
+    {
+        return -1;
+    }
+    while(stress_done < threads)
+    {
+        uthread_sleep_usecs(200);
+    }
+    long expected_sum = (long) STRESS_ITEMS * (STRESS_ITEMS + 1) / 2;
+    if(counter != 2 * STRESS_COUNTERS * STRESS_INCREMENTS || received_sum != expected_sum || !stress_pipe_read)
+    {
+        std::cout<<"FAIL stress run "<<run<<": counter "<<counter<<" of "<<2 * STRESS_COUNTERS * STRESS_INCREMENTS
+                 <<", channel sum "<<received_sum<<" of "<<expected_sum<<", pipe read "<<stress_pipe_read<<"\n";
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * repeats the stress run - the lost increments it looks for showed in a few runs of forty
+ * @return 0 on success, -1 otherwise
+*/
+static int stress_test(int runs)
+{
+    if(uthread_init(QUANTUM_USECS, STRESS_WORKERS) < 0 || pipe(stress_pipe) < 0)
+    {
+        return -1;
+    }
+    counter_mutex = uthread_mutex_create();
+    channel = uthread_chan_create(CHANNEL_CAPACITY);
+    if(counter_mutex < 0 || channel < 0)
+    {
+        return -1;
+    }
+    for(int run = 0; run < runs; run++)
+    {
+        if(stress_run(run) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * a thread per pipe waits for it, the main thread wakes them in turn and waits until each read its byte
+ * @return 0 on success, -1 otherwise
+*/
+static int wait_fd_test(int num_workers)
+{
+    if(uthread_init(QUANTUM_USECS, num_workers) < 0)
+    {
+        return -1;
+    }
+    for(int i = 0; i < WAIT_FD_THREADS; i++)
+    {
+        if(pipe(pipes[i]) < 0)
+        {
+            return -1;
+        }
+    }
+    // tids are handed out from 1, so a reader's tid modulo WAIT_FD_THREADS is its pipe
+    for(int i = 1; i <= WAIT_FD_THREADS; i++)
+    {
+        if(uthread_spawn(&pipe_reader) != i)
+        {
+            return -1;
+        }
+    }
+    for(int round = 0; round < WAIT_FD_ROUNDS; round++)
+    {
+        for(int i = 0; i < WAIT_FD_THREADS; i++)
+        {
+            if(write(pipes[i][1], "x", 1) != 1)
+            {
+                return -1;
+            }
+        }
+        for(int i = 0; i < WAIT_FD_THREADS; i++)
+        {
+            while(woken[i] <= round)
+            {
+                uthread_sleep_usecs(100);
+            }
+        }
+    }
+    if(failures != 0)
+    {
+        std::cout<<"FAIL wait_fd: "<<failures<<" wakeups without the pipe readable\n";
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char ** argv)
+{
+    if(argc < 2)
+    {
+        std::cerr<<"usage: "<<argv[0]<<" wait_fd [workers] | stress [runs]\n";
+        return 1;
+    }
+    int result = -1;
+    if(strcmp(argv[1], "wait_fd") == 0)
+    {
+        result = wait_fd_test(argc > 2 ? atoi(argv[2]) : 1);
+    }
+    else if(strcmp(argv[1], "stress") == 0)
+    {
+        result = stress_test(argc > 2 ? atoi(argv[2]) : STRESS_RUNS);
+    }
+    else
+    {
+        std::cerr<<"unknown test "<<argv[1]<<"\n";
+        return 1;
+    }
+    if(result != 0)
+    {
+        std::cout<<"FAIL "<<argv[1]<<"\n";
+        return 1;
+    }
+    std::cout<<"PASS "<<argv[1]<<"\n";
+    uthread_terminate(0);
+    return 0;
+}
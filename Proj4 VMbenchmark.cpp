@@ -0,0 +1,238 @@
+#include "VirtualMemory.h"
+#include "PhysicalMemory.h"
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <time.h>
+#include <vector>
+
+/*
+ * Trace replay benchmark of the virtual memory. Replays generated address traces - sequential, local (a sliding
+ * window of a few pages), strided, uniform random, Zipf and a loop over a hot set - or a recorded one through
+ * VMread/VMwrite, once with every page replacement policy so their fault rates compare, and prints the counters of
+ * every replay as one JSON object per line:
+ *
+ *   VMbenchmark [accesses]            the generated traces, accesses long each
+ *   VMbenchmark -f trace_file         a recorded trace, a line per access: "r <hex address>" or "w <hex address>"
+ *
+ * Built with the virtual memory and a physical memory, e.g.
+ *   g++ -O2 "Proj4 VMbenchmark.cpp" "Proj4 VirtualMemory.cpp" PhysicalMemory.cpp -o VMbenchmark
+ * OFFSET_WIDTH and VIRTUAL_ADDRESS_WIDTH, which give TABLES_DEPTH, are compile time constants of
+ * MemoryConstants.h, so a configuration is a build - every line carries the configuration it was measured with,
+ * and the outputs of several builds concatenate to a single result set.
+ * Every replay runs once with the TLB on and once with it off, "tlb" in the configuration of the line tells which -
+ * the difference of their measured PM reads is what the TLB saves.
+ */
+
+// the counters and policies of the virtual memory, beyond the interface of VirtualMemory.h
+void VMprintStats(FILE* stream);
+int VMsetReplacementPolicy(int replacement_policy);
+void VMsetTlb(int enable);
+
+#define DEFAULT_ACCESSES 200000
+#define WRITE_EVERY 5                   // every fifth access of a generated trace is a write
+#define ZIPF_EXPONENT 1.0
+#define LOCAL_WINDOW_PAGES 8            // the pages a local trace picks from at random, moving a page at a time
+#define TRACE_SEED 17
+#define NUM_POLICIES 3                  // cyclic distance, CLOCK and aging LRU
+
+struct trace_access
+{
+    uint64_t address;
+    bool write;
+};
+
+/*
+ * Monotonic time of the replays, in nanoseconds.
+ */
+static long clock_nsecs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+/*
+ * A page index to a page spread over the virtual memory - NUM_PAGES is a power of two, so multiplying by an odd
+ * number is a permutation of the pages.
+ */
+static uint64_t spread_page(uint64_t rank)
+{
+    return (rank * 0x9E3779B97F4A7C15ULL) % NUM_PAGES;
+}
+
+/*
+ * Draws page ranks with probability proportional to 1/rank^ZIPF_EXPONENT, by a binary search of the cumulative
+ * distribution.
+ */
+struct zipf_pages
+{
+    std::vector<double> cumulative;
+
+    zipf_pages()
+    {
+        cumulative.resize(NUM_PAGES);
+        double sum = 0;
+        for(uint64_t rank = 0; rank < (uint64_t)NUM_PAGES; rank++)
+        {
+            sum += 1.0 / std::pow((double)(rank + 1), ZIPF_EXPONENT);
+            cumulative[rank] = sum;
+        }
+    }
+
+    uint64_t draw(std::mt19937_64 &random)
+    {
+        double target = std::uniform_real_distribution<double>(0, cumulative.back())(random);
+        return std::lower_bound(cumulative.begin(), cumulative.end(), target) - cumulative.begin();
+    }
+};
+
+/*
+ * Generates the named trace of the given length. The loop goes over as many consecutive pages as there are frames,
+ * a few more than fit in the physical memory next to their tables.
+ */
+static std::vector<trace_access> generate_trace(const std::string &name, uint64_t accesses)
+{
+    std::vector<trace_access> trace(accesses);
+    std::mt19937_64 random(TRACE_SEED);
+    std::uniform_int_distribution<uint64_t> any_address(0, VIRTUAL_MEMORY_SIZE - 1);
+    std::uniform_int_distribution<uint64_t> any_offset(0, PAGE_SIZE - 1);
+    std::uniform_int_distribution<uint64_t> window_page(0, LOCAL_WINDOW_PAGES - 1);
+    zipf_pages *zipf = name == "zipf" ? new zipf_pages() : nullptr;
+    for(uint64_t i = 0; i<accesses; i++)
+    {
+        uint64_t address = 0;
+        if(name == "sequential")
+        {
+            address = i % VIRTUAL_MEMORY_SIZE;
+        }
+        else if(name == "local")
+        {
+            uint64_t first_page = i / (LOCAL_WINDOW_PAGES * PAGE_SIZE);
+            uint64_t page = first_page + window_page(random);
+            address = (page * PAGE_SIZE + any_offset(random)) % VIRTUAL_MEMORY_SIZE;
+        }
+        else if(name == "strided")
+        {
+            // a word of every page in turn
+            address = (i * PAGE_SIZE + i / NUM_PAGES) % VIRTUAL_MEMORY_SIZE;
+        }
+        else if(name == "random")
+        {
+            address = any_address(random);
+        }
+        else if(name == "zipf")
+        {
+            address = spread_page(zipf->draw(random)) * PAGE_SIZE + any_offset(random);
+        }
+        else if(name == "loop")
+        {
+            address = (i % NUM_FRAMES) * PAGE_SIZE + (i / NUM_FRAMES) % PAGE_SIZE;
+        }
+        trace[i] = {address, i % WRITE_EVERY == 0};
+    }
+    delete zipf;
+    return trace;
+}
+
+/*
+ * Reads a recorded trace, a line per access. Addresses beyond the virtual memory wrap around.
+ * returns false if the file cannot be read.
+ */
+static bool read_trace(const char *path, std::vector<trace_access> &trace)
+{
+    FILE *file = fopen(path, "r");
+    if(file == nullptr)
+    {
+        return false;
+    }
+    char command;
+    uint64_t address;
+    while(fscanf(file, " %c %" SCNx64, &command, &address) == 2)
+    {
+        trace.push_back({address % VIRTUAL_MEMORY_SIZE, command == 'w' or command == 'W'});
+    }
+    fclose(file);
+    return !trace.empty();
+}
+
+/*
+ * Replays the trace on a fresh virtual memory with the given replacement policy and the TLB on or off, and prints
+ * its counters with the name of the trace and the time per access.
+ * returns the accesses that failed.
+ */
+static uint64_t replay(const std::string &name, const std::vector<trace_access> &trace, int replacement_policy,
+                       bool tlb)
+{
+    VMsetTlb(tlb);
+    VMinitialize();
+    VMsetReplacementPolicy(replacement_policy);
+    uint64_t failed = 0;
+    long start = clock_nsecs();
+    for(uint64_t i = 0; i<trace.size(); i++)
+    {
+        word_t value = (word_t)i;
+        if(!(trace[i].write ? VMwrite(trace[i].address, value) : VMread(trace[i].address, &value)))
+        {
+            failed++;
+        }
+    }
+    long elapsed = clock_nsecs() - start;
+    // the counters, without the newline ending them
+    char *stats = nullptr;
+    size_t length = 0;
+    FILE *stream = open_memstream(&stats, &length);
+    VMprintStats(stream);
+    fclose(stream);
+    while(length > 0 and stats[length - 1] == '\n')
+    {
+        stats[--length] = '\0';
+    }
+    printf("{\"trace\": \"%s\", \"ns_per_access\": %.1f, \"failed\": %" PRIu64 ", \"vm\": %s}\n", name.c_str(),
+           (double)elapsed / (double)trace.size(), failed, stats);
+    fflush(stdout);
+    free(stats);
+    return failed;
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t failed = 0;
+    if(argc > 2 and strcmp(argv[1], "-f") == 0)
+    {
+        std::vector<trace_access> trace;
+        if(!read_trace(argv[2], trace))
+        {
+            fprintf(stderr, "cannot read a trace from %s\n", argv[2]);
+            return 1;
+        }
+        for(int replacement_policy = 0; replacement_policy<NUM_POLICIES; replacement_policy++)
+        {
+            failed += replay(argv[2], trace, replacement_policy, true);
+            failed += replay(argv[2], trace, replacement_policy, false);
+        }
+        return failed == 0 ? 0 : 1;
+    }
+    long accesses = argc > 1 ? atol(argv[1]) : DEFAULT_ACCESSES;
+    if(accesses <= 0)
+    {
+        fprintf(stderr, "usage: %s [accesses] | -f trace_file\n", argv[0]);
+        return 1;
+    }
+    const char *traces[] = {"sequential", "local", "strided", "random", "zipf", "loop"};
+    for(const char *name : traces)
+    {
+        std::vector<trace_access> trace = generate_trace(name, accesses);
+        for(int replacement_policy = 0; replacement_policy<NUM_POLICIES; replacement_policy++)
+        {
+            failed += replay(name, trace, replacement_policy, true);
+            failed += replay(name, trace, replacement_policy, false);
+        }
+    }
+    return failed == 0 ? 0 : 1;
+}
@@ -1,71 +1,245 @@
 #include "VirtualMemory.h"
 #include "PhysicalMemory.h"
+#include <atomic>
+#include <cinttypes>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <vector>
 
-int initialize_frame_to_zeros(uint64_t frame_index)
+// block physical memory operations - weak, so they are used if the physical memory provides them, and done word by
+// word otherwise
+void PMzeroFrame(uint64_t frameIndex) __attribute__((weak));
+void PMreadBlock(uint64_t physicalAddress, word_t* values, uint64_t count) __attribute__((weak));
+void PMwriteBlock(uint64_t physicalAddress, const word_t* values, uint64_t count) __attribute__((weak));
+
+// software TLB - recent page to frame translations, a set of TLB_WAYS entries per page index modulo TLB_SETS. An
+// entry is the page index plus one above the frame index in a single word, 0 if it is invalid, so the walks under
+// the shared lock fill it in one store and a hit never sees half of an entry.
+#define TLB_SETS 16
+#define TLB_WAYS 4
+#define TLB_FRAME_BITS (PHYSICAL_ADDRESS_WIDTH - OFFSET_WIDTH)
+#define TLB_FRAME_MASK ((1ULL << TLB_FRAME_BITS) - 1)
+static_assert(VIRTUAL_ADDRESS_WIDTH - OFFSET_WIDTH + 1 + TLB_FRAME_BITS <= 64, "a TLB entry must fit in a word");
+
+std::atomic<uint64_t> tlb[TLB_SETS][TLB_WAYS];
+std::atomic<int> tlb_next_way[TLB_SETS];    // round robin replacement within a set
+bool tlb_enabled = true;        // off, every translation misses and walks the tables
+std::atomic<uint64_t> tlb_hits(0);
+std::atomic<uint64_t> tlb_misses(0);
+
+// page replacement policies - the page furthest from the faulting page cyclically, CLOCK (second chance), and
+// LRU approximated by aging: every NUM_FRAMES accesses each page's age is shifted right, its referenced bit in the
+// top bit
+enum replacement_policy {CYCLIC_DISTANCE, CLOCK, AGING_LRU};
+#define AGE_BITS 8
+
+// readahead - the streams whose next page is watched for, and NO_PAGE, which is not a page index
+#define READAHEAD_STREAMS 4
+#define NO_PAGE NUM_PAGES
+
+// side metadata of the frames, kept in step with the tables so that a page fault needs no walk of the tree
+struct frame_info
 {
-    for(int i = 0; i<PAGE_SIZE; i++)
+    uint64_t parent;        // the table referencing the frame, and the row in it
+    int row;
+    int depth;              // 0 for the root table, TABLES_DEPTH for a page
+    uint64_t key;           // a page's index, a table's path shifted to the width of a page index - in DFS order
+    int children;           // the non zero rows of a table
+    bool dirty;             // a page whose only copy is in RAM - written, or restored from the swap
+    bool referenced;        // a page accessed since its bit was last cleared
+    int age;
+};
+
+std::vector<frame_info> frames;
+uint64_t used_frames = 0;                               // frames are used from 0 up, and never freed for good
+std::set<std::pair<uint64_t, uint64_t>> empty_tables;   // (key, frame) of the tables with no rows but the root
+std::map<uint64_t, uint64_t> resident_pages;            // page index -> frame
+std::set<uint64_t> swapped_pages;                       // pages with a copy in the swap
+uint64_t evictions = 0;
+uint64_t avoided_evictions = 0;                         // clean pages dropped instead of evicted
+replacement_policy policy = CYCLIC_DISTANCE;
+uint64_t clock_hand = 0;
+std::atomic<uint64_t> accesses(0);
+uint64_t aged_accesses = 0;                             // the accesses counted when the pages were last aged
+uint64_t readahead_pages = 0;
+uint64_t stream_next[READAHEAD_STREAMS];                // the page whose fault continues the stream
+int oldest_stream = 0;
+uint64_t pinned_page = NO_PAGE;                         // the page the pages being prefetched must not evict
+uint64_t page_faults = 0;
+uint64_t prefetched_pages = 0;
+
+// accounting - words read from and written to the physical memory (blocks included), words accessed through the VM,
+// and the page table walks with the table levels they read
+std::atomic<uint64_t> pm_reads(0);
+std::atomic<uint64_t> pm_writes(0);
+std::atomic<uint64_t> word_accesses(0);
+uint64_t restores = 0;
+std::atomic<uint64_t> walks(0);
+std::atomic<uint64_t> walk_levels(0);
+
+// concurrent mode - accesses to resident pages share vm_lock, page faults hold it exclusively. An access to a
+// resident page only reads the tables, and what it stores - a TLB entry, the flags of its frame and the counters -
+// is stored atomically.
+bool concurrent = false;
+std::shared_mutex vm_lock;
+
+/*
+ * Looks the page up in the TLB. Keeping the frame holding it in *frame on a hit.
+ */
+bool tlb_probe(uint64_t page, uint64_t *frame)
+{
+    if(!tlb_enabled)
     {
-        PMwrite(frame_index*PAGE_SIZE + i,0);
+        return false;
     }
-    return 0;
+    std::atomic<uint64_t> *set = tlb[page % TLB_SETS];
+    for(int i = 0; i<TLB_WAYS; i++)
+    {
+        uint64_t entry = set[i].load(std::memory_order_relaxed);
+        if(entry >> TLB_FRAME_BITS == page + 1)
+        {
+            *frame = entry & TLB_FRAME_MASK;
+            return true;
+        }
+    }
+    return false;
 }
 
-void VMinitialize()
+/*
+ * Looks the page up in the TLB like tlb_probe, counting the hit or the miss.
+ */
+bool tlb_lookup(uint64_t page, uint64_t *frame)
 {
-    initialize_frame_to_zeros(0);
+    if(tlb_probe(page, frame))
+    {
+        tlb_hits.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    tlb_misses.fetch_add(1, std::memory_order_relaxed);
+    return false;
 }
 
-
-
-/*
- * Find frame containing empty table- all rows are 0. Keeping the frame index, it's parent index and the row referencing it.
- */
-void first_priority(uint64_t current_frame,uint64_t current_parent,word_t current_parent_row, uint64_t * all_zeros_frame,uint64_t *all_zeros_parent,int *all_zeros_row, uint64_t invalid_frame_index,int tree_depth)
+void tlb_insert(uint64_t page, uint64_t frame)
 {
-    if(tree_depth == TABLES_DEPTH)
+    if(!tlb_enabled)
     {
         return;
     }
-    // halting the recursion.
-    bool all_rows_are_zeros = true;
-    for(int i = 0; i<PAGE_SIZE;i++)
+    int way = tlb_next_way[page % TLB_SETS].fetch_add(1, std::memory_order_relaxed) % TLB_WAYS;
+    tlb[page % TLB_SETS][way].store((page + 1) << TLB_FRAME_BITS | frame, std::memory_order_relaxed);
+}
+
+/*
+ * Drops the translations to the frame - it is about to hold another page or table.
+ */
+void tlb_invalidate_frame(uint64_t frame)
+{
+    for(int i = 0; i<TLB_SETS; i++)
     {
-        word_t read_value = 0;
-        PMread(current_frame*PAGE_SIZE + i,&read_value);
-        if(read_value!=0)
+        for(int j = 0; j<TLB_WAYS; j++)
         {
-            all_rows_are_zeros = false;
-            first_priority(read_value, current_frame, i,all_zeros_frame,all_zeros_parent,all_zeros_row,invalid_frame_index,tree_depth+1);
+            uint64_t entry = tlb[i][j].load(std::memory_order_relaxed);
+            if(entry != 0 and (entry & TLB_FRAME_MASK) == frame)
+            {
+                tlb[i][j].store(0, std::memory_order_relaxed);
+            }
         }
     }
-    if(all_rows_are_zeros and current_frame!=invalid_frame_index and *all_zeros_frame==0)
+}
+
+int initialize_frame_to_zeros(uint64_t frame_index)
+{
+    pm_writes.fetch_add(PAGE_SIZE, std::memory_order_relaxed);
+    if(PMzeroFrame != nullptr)
+    {
+        PMzeroFrame(frame_index);
+        return 0;
+    }
+    for(int i = 0; i<PAGE_SIZE; i++)
     {
-        *all_zeros_frame = current_frame;
-        *all_zeros_parent = current_parent;
-        *all_zeros_row = current_parent_row;
+        PMwrite(frame_index*PAGE_SIZE + i,0);
     }
+    return 0;
 }
 
+void read_block(uint64_t physical_address, word_t* values, uint64_t count)
+{
+    pm_reads.fetch_add(count, std::memory_order_relaxed);
+    if(PMreadBlock != nullptr)
+    {
+        PMreadBlock(physical_address, values, count);
+        return;
+    }
+    for(uint64_t i = 0; i<count; i++)
+    {
+        PMread(physical_address + i, &values[i]);
+    }
+}
 
-void second_priority(int current_frame, int *max_frame, int tree_depth)
+void write_block(uint64_t physical_address, const word_t* values, uint64_t count)
 {
-    if(*max_frame < current_frame)
+    pm_writes.fetch_add(count, std::memory_order_relaxed);
+    if(PMwriteBlock != nullptr)
     {
-        *max_frame = current_frame;
+        PMwriteBlock(physical_address, values, count);
+        return;
     }
-    if(tree_depth == TABLES_DEPTH){return;}    // halting the recursion.
-    for(int i = 0; i<PAGE_SIZE;i++)
+    for(uint64_t i = 0; i<count; i++)
     {
-        word_t read_value = 0;
-        PMread(current_frame*PAGE_SIZE + i,&read_value);
-        if(read_value != 0)
-        {
+        PMwrite(physical_address + i, values[i]);
+    }
+}
 
-            second_priority(read_value, max_frame,tree_depth+1);
+/* Zeroes all the counters of the virtual memory, as VMinitialize does.
+ */
+void VMresetStats()
+{
+    tlb_hits = 0;
+    tlb_misses = 0;
+    evictions = 0;
+    avoided_evictions = 0;
+    page_faults = 0;
+    prefetched_pages = 0;
+    pm_reads = 0;
+    pm_writes = 0;
+    word_accesses = 0;
+    restores = 0;
+    walks = 0;
+    walk_levels = 0;
+}
+
+void VMinitialize()
+{
+    initialize_frame_to_zeros(0);
+    for(int i = 0; i<TLB_SETS; i++)
+    {
+        for(int j = 0; j<TLB_WAYS; j++)
+        {
+            tlb[i][j].store(0, std::memory_order_relaxed);
         }
+        tlb_next_way[i].store(0, std::memory_order_relaxed);
     }
+    frames.assign(NUM_FRAMES, frame_info());
+    used_frames = 1;
+    empty_tables.clear();
+    resident_pages.clear();
+    swapped_pages.clear();
+    clock_hand = 0;
+    accesses = 0;
+    aged_accesses = 0;
+    for(int i = 0; i<READAHEAD_STREAMS; i++)
+    {
+        stream_next[i] = NO_PAGE;
+    }
+    oldest_stream = 0;
+    VMresetStats();
 }
 
+
+
 int find_min(const int first_num, const int sec_num)
 {
     if(first_num < sec_num){return first_num;}
@@ -78,43 +252,221 @@ int abs_value(const int number)
     return number;
 }
 
-void third_priority(uint64_t current_frame,uint64_t current_parent, int current_parent_row, int tree_depth, int p, uint64_t *evict_page,uint64_t *evict_frame,int *evict_value,uint64_t *evict_parent, int *evict_parent_row,  int page_index)
+/*
+ * Writes the row of the parent table referencing the frame, and updates the metadata of both.
+ */
+void link_frame(uint64_t parent, int row, uint64_t frame, int depth, uint64_t key)
 {
-    if(tree_depth == TABLES_DEPTH)
+    PMwrite(parent*PAGE_SIZE + row, (word_t)frame);
+    pm_writes++;
+    frames[frame] = {parent, row, depth, key, 0, false, false, 0};
+    if(frames[parent].children++ == 0 and parent != 0)
     {
-        int temp_value = find_min((int)NUM_PAGES - abs_value(page_index - p), abs_value(page_index - p));
-        if(*evict_value < temp_value)
-        {
-            *evict_page = p;
-            *evict_frame = current_frame;
-            *evict_value = temp_value;
-            *evict_parent = current_parent;
-            *evict_parent_row = current_parent_row;
-        }
-        return;
+        empty_tables.erase({frames[parent].key, parent});
     }
-    for(int i = 0; i<PAGE_SIZE;i++)
+    if(depth == TABLES_DEPTH)
     {
-        word_t read_value = 0;
-        PMread(current_frame*PAGE_SIZE + i,&read_value);
-        if(read_value != 0)
+        resident_pages[key] = frame;
+    }
+    else
+    {
+        empty_tables.insert({key, frame});
+    }
+}
+
+/*
+ * Zeroes the row of the parent table referencing the frame, and updates the metadata of both.
+ */
+void unlink_frame(uint64_t frame)
+{
+    frame_info info = frames[frame];
+    PMwrite(info.parent*PAGE_SIZE + info.row, 0);
+    pm_writes++;
+    if(--frames[info.parent].children == 0 and info.parent != 0)
+    {
+        empty_tables.insert({frames[info.parent].key, info.parent});
+    }
+    if(info.depth == TABLES_DEPTH)
+    {
+        resident_pages.erase(info.key);
+    }
+    else
+    {
+        empty_tables.erase({info.key, frame});
+    }
+}
+
+/*
+ * The resident page with the largest cyclic distance from page_index, the lowest such page on a tie.
+ * The distance from page_index is the largest for the pages closest to its antipode - which are its successor and
+ * predecessor among the resident pages, cyclically.
+ */
+uint64_t cyclic_distance_victim(uint64_t page_index)
+{
+    auto after = resident_pages.lower_bound((page_index + NUM_PAGES/2) % NUM_PAGES);
+    if(after == resident_pages.end())
+    {
+        after = resident_pages.begin();
+    }
+    auto before = after == resident_pages.begin() ? std::prev(resident_pages.end()) : std::prev(after);
+    int after_value = find_min((int)NUM_PAGES - abs_value((int)page_index - (int)after->first), abs_value((int)page_index - (int)after->first));
+    int before_value = find_min((int)NUM_PAGES - abs_value((int)page_index - (int)before->first), abs_value((int)page_index - (int)before->first));
+    if(before_value > after_value or (before_value == after_value and before->first < after->first))
+    {
+        return before->first;
+    }
+    return after->first;
+}
+
+/*
+ * The first page the clock hand reaches with its referenced bit clear, clearing the bits it passes.
+ */
+uint64_t clock_victim()
+{
+    for(;;)
+    {
+        frame_info &info = frames[clock_hand];
+        clock_hand = (clock_hand + 1) % used_frames;
+        if(info.depth == TABLES_DEPTH and info.key != pinned_page)
         {
-            int temp_p = p + i;
-            if(tree_depth < TABLES_DEPTH-1)
+            if(!info.referenced)
             {
-                temp_p = temp_p << OFFSET_WIDTH;
+                return info.key;
             }
+            info.referenced = false;
+        }
+    }
+}
 
-            third_priority(read_value,current_frame, i, tree_depth+1, temp_p,evict_page,evict_frame,evict_value,evict_parent, evict_parent_row, page_index);
+/*
+ * The page with the lowest age, counting a page referenced since the last aging as one step younger.
+ * The lowest such page on a tie.
+ */
+uint64_t aging_victim()
+{
+    uint64_t victim = resident_pages.begin()->first;
+    int victim_age = 1 << (AGE_BITS+1);     // above any score, which has AGE_BITS+1 bits
+    for(auto &page : resident_pages)
+    {
+        int age = frames[page.second].age * 2 + frames[page.second].referenced;
+        if(age < victim_age)
+        {
+            victim = page.first;
+            victim_age = age;
         }
     }
+    return victim;
 }
 
-int apply_read_or_write_command(uint64_t virtualAddress, int command, word_t* read_value = nullptr, word_t write_value = 0)
+/*
+ * The page to evict for page_index by the replacement policy. The pinned page is left out of the choice.
+ */
+uint64_t choose_victim(uint64_t page_index)
+{
+    uint64_t pinned_frame = 0;
+    auto pinned = resident_pages.find(pinned_page);
+    if(pinned != resident_pages.end())
+    {
+        pinned_frame = pinned->second;
+        resident_pages.erase(pinned);
+    }
+    uint64_t victim;
+    switch(policy)
+    {
+        case CLOCK:
+            victim = clock_victim();
+            break;
+        case AGING_LRU:
+            victim = aging_victim();
+            break;
+        default:
+            victim = cyclic_distance_victim(page_index);
+            break;
+    }
+    if(pinned_frame != 0)
+    {
+        resident_pages[pinned_page] = pinned_frame;
+    }
+    return victim;
+}
+
+/*
+ * Marks the frame's page as accessed. It may be called under the shared lock.
+ */
+void reference_frame(uint64_t frame)
+{
+    __atomic_store_n(&frames[frame].referenced, true, __ATOMIC_RELAXED);
+    accesses.fetch_add(1, std::memory_order_relaxed);
+}
+
+/*
+ * Ages all the pages under the aging policy, once NUM_FRAMES accesses passed since they were last aged.
+ */
+void age_pages()
 {
-    uint64_t pageIndex = virtualAddress / PAGE_SIZE;
-    uint64_t pageOffset = virtualAddress % PAGE_SIZE;
+    if(policy != AGING_LRU or accesses.load(std::memory_order_relaxed) - aged_accesses < NUM_FRAMES)
+    {
+        return;
+    }
+    aged_accesses += NUM_FRAMES;
+    for(auto &page : resident_pages)
+    {
+        frame_info &info = frames[page.second];
+        info.age = (info.age >> 1) | (info.referenced << (AGE_BITS-1));
+        info.referenced = false;
+    }
+}
+
+/*
+ * Finds a frame for a new table or page, by priority: an empty table other than the table at invalid_frame_index
+ * (the first in DFS order), an unused frame, or the frame of the replacement policy's victim, evicted. A clean
+ * page is all zeros and has no copy in the swap, so it is dropped instead - restoring it later finds nothing and
+ * leaves its frame zeroed, just the same.
+ * returns the frame, unlinked and filled with zeros.
+ */
+uint64_t allocate_frame(uint64_t invalid_frame_index, uint64_t page_index)
+{
+    for(auto &table : empty_tables)
+    {
+        if(table.second != invalid_frame_index)
+        {
+            uint64_t frame = table.second;
+            tlb_invalidate_frame(frame);
+            unlink_frame(frame);
+            return frame;
+        }
+    }
+    if(used_frames < NUM_FRAMES)
+    {
+        initialize_frame_to_zeros(used_frames);
+        return used_frames++;
+    }
+    uint64_t evict_page = choose_victim(page_index);
+    uint64_t evict_frame = resident_pages[evict_page];
+    tlb_invalidate_frame(evict_frame);
+    if(frames[evict_frame].dirty)
+    {
+        PMevict(evict_frame, evict_page);
+        swapped_pages.insert(evict_page);
+        evictions++;
+    }
+    else
+    {
+        avoided_evictions++;
+    }
+    unlink_frame(evict_frame);
+    initialize_frame_to_zeros(evict_frame);
+    return evict_frame;
+}
 
+/*
+ * Walks the page tables to the frame holding the given page, handling the page faults on the way. Keeping whether
+ * the page itself was missing in *faulted.
+ * returns the frame index.
+ */
+uint64_t map_page(uint64_t pageIndex, bool *faulted)
+{
+    walks++;
     // creating table index array (p1, p2, p3...) *****************************
     uint64_t table_index_array[TABLES_DEPTH] = {};
     word_t shifter = PAGE_SIZE - 1;
@@ -128,70 +480,183 @@ int apply_read_or_write_command(uint64_t virtualAddress, int command, word_t* re
 
     uint64_t address = 0;
     word_t new_address = 0;
+    bool fresh_table = false;   // a table allocated by this walk - all its rows are zeros, no need to read them
     for(int i = 0;i<TABLES_DEPTH;i++)
     {
-        PMread(address*PAGE_SIZE+table_index_array[i],&new_address);
-        if(new_address == 0)
+        if(!fresh_table)
         {
-            uint64_t all_zeros_frame = 0;
-            uint64_t all_zeros_parent = 0;
-            int all_zeros_row = 0;
-            first_priority(0,0,0,&all_zeros_frame,&all_zeros_parent,&all_zeros_row,address,0);
-
-            if(all_zeros_frame != 0)
-            {
-                PMwrite(all_zeros_parent*PAGE_SIZE + all_zeros_row, 0);
-                if(i == TABLES_DEPTH-1)
-                {
-                    PMrestore(all_zeros_frame, pageIndex);
-                }
-//                    initialize_frame_to_zeros(all_zeros_frame);
-                PMwrite(address*PAGE_SIZE+table_index_array[i], (word_t)all_zeros_frame);
-                address = all_zeros_frame;
-                continue;
-            }
-            int max_frame = 0;
-            second_priority(0,&max_frame,0);
-            if(max_frame + 1 < NUM_FRAMES)
+            PMread(address*PAGE_SIZE+table_index_array[i],&new_address);
+            pm_reads++;
+            walk_levels++;
+        }
+        if(fresh_table or new_address == 0)
+        {
+            fresh_table = true;
+            int shift = OFFSET_WIDTH * (TABLES_DEPTH-1-i);
+            uint64_t frame = allocate_frame(address, pageIndex);
+            if(i == TABLES_DEPTH-1)
             {
-                if(i == TABLES_DEPTH-1)
-                {
-                    PMrestore(max_frame+1, pageIndex);
-                }
-                initialize_frame_to_zeros(max_frame+1);
-                PMwrite(address*PAGE_SIZE+table_index_array[i], max_frame+1);
-                address = max_frame+1;
-                continue;
+                PMrestore(frame, pageIndex);
+                restores++;
             }
-            uint64_t evict_page = 0;
-            uint64_t evict_frame = 0;
-            int evict_value = 0;
-            uint64_t evict_parent = 0;
-            int evict_parent_row = 0;
-            third_priority(0,0,0,0,0,&evict_page,&evict_frame,&evict_value,&evict_parent,&evict_parent_row, (word_t)pageIndex);
-            PMevict(evict_frame, evict_page);
-            PMwrite(evict_parent*PAGE_SIZE + evict_parent_row, 0);
-            initialize_frame_to_zeros(evict_frame);
+            link_frame(address, (int)table_index_array[i], frame, i+1, (pageIndex >> shift) << shift);
             if(i == TABLES_DEPTH-1)
             {
-                PMrestore(evict_frame, pageIndex);
+                // the swap gives its copy up on restore, RAM holds the only copy of a page that was evicted
+                frames[frame].dirty = swapped_pages.erase(pageIndex) != 0;
+                *faulted = true;
             }
-            PMwrite(address*PAGE_SIZE+table_index_array[i], (word_t)evict_frame);
-            address = evict_frame;
+            address = frame;
         }
         else
         {
             address = new_address;
         }
     }
+    tlb_insert(pageIndex, address);
+    return address;
+}
+
+/*
+ * Called on a fault on the page. A fault on the page a stream expects is sequential, and the readahead_pages pages
+ * that follow are mapped in advance - without evicting the page itself. Any other fault starts a new stream.
+ */
+void read_ahead(uint64_t page)
+{
+    int stream = 0;
+    while(stream < READAHEAD_STREAMS and stream_next[stream] != page)
+    {
+        stream++;
+    }
+    if(stream == READAHEAD_STREAMS)
+    {
+        stream_next[oldest_stream] = page + 1;
+        oldest_stream = (oldest_stream + 1) % READAHEAD_STREAMS;
+        return;
+    }
+    pinned_page = page;
+    uint64_t ahead = page + 1;
+    for(; ahead <= page + readahead_pages and ahead < NUM_PAGES; ahead++)
+    {
+        // mapping a page may take a frame for each table level, each evicting a page other than the pinned one
+        if(used_frames == NUM_FRAMES and resident_pages.size() <= TABLES_DEPTH)
+        {
+            break;
+        }
+        if(resident_pages.count(ahead) == 0)
+        {
+            bool faulted = false;
+            // referenced, or the replacement policy would take it for the first victim before it is used
+            frames[map_page(ahead, &faulted)].referenced = true;
+            prefetched_pages++;
+        }
+    }
+    pinned_page = NO_PAGE;
+    stream_next[stream] = ahead;
+}
+
+/*
+ * Walks the page tables to the frame holding the given page, if the page is resident, without changing them - so
+ * it may run under the shared lock. Keeping the frame in *frame and in the TLB.
+ * returns false if a table on the way or the page is missing.
+ */
+bool walk_resident(uint64_t pageIndex, uint64_t *frame)
+{
+    walks.fetch_add(1, std::memory_order_relaxed);
+    uint64_t address = 0;
+    for(int i = 0; i<TABLES_DEPTH; i++)
+    {
+        uint64_t row = (pageIndex >> (OFFSET_WIDTH * (TABLES_DEPTH-1-i))) & (PAGE_SIZE - 1);
+        word_t next_address = 0;
+        PMread(address*PAGE_SIZE + row, &next_address);
+        pm_reads.fetch_add(1, std::memory_order_relaxed);
+        walk_levels.fetch_add(1, std::memory_order_relaxed);
+        if(next_address == 0)
+        {
+            return false;
+        }
+        address = next_address;
+    }
+    tlb_insert(pageIndex, address);
+    *frame = address;
+    return true;
+}
+
+/*
+ * The frame holding the given page, from the TLB or by walking the page tables.
+ * returns the frame index.
+ */
+uint64_t translate_page(uint64_t pageIndex)
+{
+    uint64_t frame = 0;
+    if(tlb_lookup(pageIndex, &frame))
+    {
+        reference_frame(frame);
+        age_pages();
+        return frame;
+    }
+    bool faulted = false;
+    frame = map_page(pageIndex, &faulted);
+    reference_frame(frame);
+    age_pages();
+    if(faulted)
+    {
+        page_faults++;
+        if(readahead_pages != 0)
+        {
+            read_ahead(pageIndex);
+        }
+    }
+    return frame;
+}
+
+/*
+ * Reads count words of the frame starting at the offset into values, or writes them from there.
+ */
+void access_frame(uint64_t frame, uint64_t pageOffset, int command, word_t* values, uint64_t count)
+{
     if(command == 0)
     {
-        PMread(address*PAGE_SIZE+pageOffset, read_value);
+        read_block(frame*PAGE_SIZE + pageOffset, values, count);
+        return;
     }
-    if(command == 1)
+    write_block(frame*PAGE_SIZE + pageOffset, values, count);
+    __atomic_store_n(&frames[frame].dirty, true, __ATOMIC_RELAXED);
+}
+
+/*
+ * Applies the command to count words of the page starting at the offset. In concurrent mode an access to a resident
+ * page - a TLB hit, or a TLB miss the walk of the tables finds the page for - runs under the shared lock, along with
+ * the other such accesses. A frame cannot be evicted until the accesses using it end, since a page fault takes the
+ * exclusive lock, and only a fault changes the tables.
+ */
+void access_page(uint64_t pageIndex, uint64_t pageOffset, int command, word_t* values, uint64_t count)
+{
+    word_accesses.fetch_add(count, std::memory_order_relaxed);
+    if(concurrent)
     {
-        PMwrite(address*PAGE_SIZE+pageOffset, write_value);
+        std::shared_lock<std::shared_mutex> shared(vm_lock);
+        uint64_t frame = 0;
+        bool hit = tlb_probe(pageIndex, &frame);
+        if(hit or walk_resident(pageIndex, &frame))
+        {
+            (hit ? tlb_hits : tlb_misses).fetch_add(1, std::memory_order_relaxed);
+            reference_frame(frame);
+            access_frame(frame, pageOffset, command, values, count);
+            return;
+        }
     }
+    std::unique_lock<std::shared_mutex> exclusive(vm_lock, std::defer_lock);
+    if(concurrent)
+    {
+        exclusive.lock();
+    }
+    access_frame(translate_page(pageIndex), pageOffset, command, values, count);
+}
+
+int apply_read_or_write_command(uint64_t virtualAddress, int command, word_t* read_value = nullptr, word_t write_value = 0)
+{
+    access_page(virtualAddress / PAGE_SIZE, virtualAddress % PAGE_SIZE, command, command == 0 ? read_value : &write_value, 1);
     return 0;
 }
 /* Reads a word from the given virtual address
@@ -221,4 +686,175 @@ int VMwrite(uint64_t virtualAddress, word_t value)
     if(virtualAddress >= VIRTUAL_MEMORY_SIZE){return 0;}
     // write command means 1!
     return !apply_read_or_write_command(virtualAddress, 1, nullptr, value);
-}
\ No newline at end of file
+}
+
+
+
+/* Applies the command to count consecutive words starting at the given virtual address - reads them into
+ * values[0..count-1], or writes them from there. Each page is translated once, not once per word.
+ *
+ * returns 0 on success.
+ */
+int apply_range_command(uint64_t virtualAddress, int command, word_t* values, uint64_t count)
+{
+    uint64_t done = 0;
+    while(done < count)
+    {
+        uint64_t pageOffset = (virtualAddress + done) % PAGE_SIZE;
+        uint64_t chunk = PAGE_SIZE - pageOffset;
+        if(chunk > count - done)
+        {
+            chunk = count - done;
+        }
+        access_page((virtualAddress + done) / PAGE_SIZE, pageOffset, command, &values[done], chunk);
+        done += chunk;
+    }
+    return 0;
+}
+
+
+
+/* Reads count words starting at the given virtual address
+ * into values[0..count-1].
+ *
+ * returns 1 on success.
+ * returns 0 on failure (if any of the addresses cannot be mapped to a
+ * physical address for any reason)
+ */
+int VMreadRange(uint64_t virtualAddress, word_t* values, uint64_t count)
+{
+    if(virtualAddress >= VIRTUAL_MEMORY_SIZE or count > VIRTUAL_MEMORY_SIZE - virtualAddress){return 0;}
+    return !apply_range_command(virtualAddress, 0, values, count);
+}
+
+
+
+/* Writes values[0..count-1] to count words starting at the
+ * given virtual address.
+ *
+ * returns 1 on success.
+ * returns 0 on failure (if any of the addresses cannot be mapped to a
+ * physical address for any reason)
+ */
+int VMwriteRange(uint64_t virtualAddress, const word_t* values, uint64_t count)
+{
+    if(virtualAddress >= VIRTUAL_MEMORY_SIZE or count > VIRTUAL_MEMORY_SIZE - virtualAddress){return 0;}
+    return !apply_range_command(virtualAddress, 1, const_cast<word_t*>(values), count);
+}
+
+
+
+/* Keeps the number of translations the TLB hit and missed since
+ * VMinitialize in *hits and *misses.
+ */
+void VMgetTlbStats(uint64_t* hits, uint64_t* misses)
+{
+    *hits = tlb_hits;
+    *misses = tlb_misses;
+}
+
+
+
+/* Keeps the number of pages written back to the swap since
+ * VMinitialize in *evicted, and the number of clean pages dropped
+ * without a write back in *avoided.
+ */
+void VMgetEvictionStats(uint64_t* evicted, uint64_t* avoided)
+{
+    *evicted = evictions;
+    *avoided = avoided_evictions;
+}
+
+
+
+/* Sets the page replacement policy: 0 evicts the page furthest
+ * from the faulting page cyclically (the default), 1 is CLOCK and
+ * 2 is LRU approximated by aging.
+ *
+ * returns 1 on success.
+ * returns 0 on failure (if there is no such policy)
+ */
+int VMsetReplacementPolicy(int replacement_policy)
+{
+    if(replacement_policy < CYCLIC_DISTANCE or replacement_policy > AGING_LRU){return 0;}
+    policy = (enum replacement_policy)replacement_policy;
+    return 1;
+}
+
+
+
+/* Sets the number of pages restored ahead of a sequential access
+ * stream, 0 (the default) turns readahead off. At most a quarter of
+ * the frames may be read ahead.
+ *
+ * returns 1 on success.
+ * returns 0 on failure (if pages is out of range)
+ */
+int VMsetReadahead(int pages)
+{
+    if(pages < 0 or pages > NUM_FRAMES/4){return 0;}
+    readahead_pages = pages;
+    return 1;
+}
+
+
+
+/* Keeps the number of page faults since VMinitialize in *faults,
+ * and the number of pages restored ahead of them in *prefetched.
+ */
+void VMgetFaultStats(uint64_t* faults, uint64_t* prefetched)
+{
+    *faults = page_faults;
+    *prefetched = prefetched_pages;
+}
+
+
+
+/* Turns the TLB on (the default) or off - off, every access walks
+ * the page tables, so the PM reads of a run without it show what the
+ * TLB saves. Evictions still invalidate its entries while it is off.
+ */
+void VMsetTlb(int enable)
+{
+    tlb_enabled = enable;
+}
+
+
+
+/* Makes VMread, VMwrite, VMreadRange and VMwriteRange safe to call
+ * from several threads at once, or single threaded again. Accesses to
+ * resident pages run in parallel, page faults one at a time. Not to be
+ * called while other threads access the virtual memory, and the other
+ * VM functions are not covered.
+ */
+void VMsetConcurrent(int enable)
+{
+    concurrent = enable;
+}
+
+
+
+/* Prints the configuration of the virtual memory and its counters
+ * since VMinitialize or VMresetStats to the stream, as a single JSON
+ * object on one line.
+ */
+void VMprintStats(FILE* stream)
+{
+    const char *policy_names[] = {"cyclic_distance", "clock", "aging_lru"};
+    uint64_t accessed = word_accesses;
+    double per_access = accessed != 0 ? 1.0 / (double)accessed : 0;
+    fprintf(stream, "{\"config\": {\"offset_width\": %d, \"tables_depth\": %d, \"num_frames\": %" PRIu64
+            ", \"num_pages\": %" PRIu64 ", \"policy\": \"%s\", \"readahead_pages\": %" PRIu64
+            ", \"tlb\": %s, \"concurrent\": %s}, ", OFFSET_WIDTH, (int)TABLES_DEPTH, (uint64_t)NUM_FRAMES,
+            (uint64_t)NUM_PAGES, policy_names[policy], readahead_pages, tlb_enabled ? "true" : "false",
+            concurrent ? "true" : "false");
+    fprintf(stream, "\"accesses\": %" PRIu64 ", \"pm\": {\"reads\": %" PRIu64 ", \"writes\": %" PRIu64
+            ", \"evicts\": %" PRIu64 ", \"restores\": %" PRIu64 "}, ", accessed, pm_reads.load(), pm_writes.load(),
+            evictions, restores);
+    fprintf(stream, "\"per_access\": {\"pm_reads\": %.4f, \"pm_writes\": %.4f, \"page_faults\": %.6f}, ",
+            (double)pm_reads.load() * per_access, (double)pm_writes.load() * per_access, (double)page_faults * per_access);
+    fprintf(stream, "\"page_faults\": %" PRIu64 ", \"prefetched_pages\": %" PRIu64 ", \"avoided_evictions\": %"
+            PRIu64 ", \"tlb\": {\"hits\": %" PRIu64 ", \"misses\": %" PRIu64 "}, \"walks\": %" PRIu64
+            ", \"mean_walk_depth\": %.3f}\n", page_faults, prefetched_pages, avoided_evictions, tlb_hits.load(),
+            tlb_misses.load(), walks.load(), walks != 0 ? (double)walk_levels.load() / (double)walks.load() : 0.0);
+}